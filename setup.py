@@ -10,19 +10,33 @@ import struct
 if struct.calcsize("P") < 8:
     raise RuntimeError("Simhash-py does not work on 32-bit systems. See README.md")
 
-ext_files = ["simhash/simhash-cpp/src/permutation.cpp", "simhash/simhash-cpp/src/simhash.cpp"]
-
-kwargs = {}
+ext_files = [
+    "simhash/simhash-cpp/src/permutation.cpp",
+    "simhash/simhash-cpp/src/simhash.cpp",
+    "simhash/cpp/src/ball.cpp",
+    "simhash/cpp/src/blocks.cpp",
+    "simhash/cpp/src/brute.cpp",
+    "simhash/cpp/src/compute.cpp",
+    "simhash/cpp/src/epochs.cpp",
+    "simhash/cpp/src/find.cpp",
+    "simhash/cpp/src/pool.cpp",
+    "simhash/cpp/src/tombstones.cpp",
+    "simhash/cpp/src/memtable.cpp",
+    "simhash/cpp/src/schedule.cpp",
+    "simhash/cpp/src/stoplist.cpp",
+    "simhash/cpp/src/text.cpp",
+    "simhash/cpp/src/segment.cpp",
+    "simhash/cpp/src/index.cpp",
+]
 
+# The extension is always built from the Cython source; a checked-in copy of the
+# generated C++ would fall behind it. pyproject.toml makes pip install Cython first.
 try:
     from Cython.Distutils import build_ext
-
-    print("Building from Cython")
-    ext_files.append("simhash/simhash.pyx")
-    kwargs["cmdclass"] = {"build_ext": build_ext}
 except ImportError:
-    print("Buidling from C++")
-    ext_files.append("simhash/simhash.cpp")
+    raise RuntimeError("Building simhash-py requires Cython: pip install cython")
+
+ext_files.append("simhash/simhash.pyx")
 
 ext_modules = [
     Extension(
@@ -30,7 +44,7 @@ ext_modules = [
         ext_files,
         language="c++",
         extra_compile_args=["-std=c++11"],
-        include_dirs=["simhash/simhash-cpp/include"],
+        include_dirs=["simhash/simhash-cpp/include", "simhash/cpp/include"],
     )
 ]
 
@@ -50,6 +64,6 @@ setup(
     ext_modules=ext_modules,
     packages=["simhash"],
     package_dir={"simhash": "simhash"},
+    cmdclass={"build_ext": build_ext},
     tests_require=["coverage", "nose", "nose-timer", "rednose"],
-    **kwargs
 )
@@ -1,6 +1,12 @@
 #! /usr/bin/env python
 
-from .simhash import unsigned_hash, num_differing_bits, compute, find_all
+from .simhash import (
+    unsigned_hash, fast_hash, fast_hash_many, num_differing_bits, Stoplist,
+    compute, compute_many, compute_weighted, compute_weighted_many,
+    Accumulator, tokenize, shingle_hashes, char_ngrams, fingerprint,
+    fingerprint_many, choose_blocks, balanced_blocks, recall,
+    ball_beats_search, ball_beats_sort, find_all, find_all_external,
+    find_between, Tables, Index)
 from six.moves import range as six_range
 
 
@@ -0,0 +1,179 @@
+#ifndef SIMHASH_BALL_H
+#define SIMHASH_BALL_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+    /**
+     * The number of hashes within different_bits of any one hash, counting
+     * itself.
+     */
+    size_t ball_size(size_t different_bits);
+
+    /**
+     * Call visit(hash, distance) for every hash within different_bits of
+     * center, nearest first, starting with center itself.
+     */
+    template <typename Visit>
+    void visit_ball(hash_t center, size_t different_bits, Visit visit)
+    {
+        visit(center, size_t(0));
+        for (size_t d = 1; d <= different_bits && d < BITS; ++d) {
+            // Every mask of d bits, in increasing order.
+            hash_t flips = (hash_t(1) << d) - 1;
+            while (true) {
+                visit(center ^ flips, d);
+                hash_t lowest = flips & (~flips + 1);
+                hash_t ripple = flips + lowest;
+                if (ripple == 0) {
+                    break;
+                }
+                flips = ripple | (((ripple ^ flips) >> 2) >> __builtin_ctzll(flips));
+            }
+        }
+    }
+
+    /**
+     * Whether looking up each hash within different_bits of a query in a
+     * hash table of count hashes should be cheaper than searching this many
+     * sorted tables of them for it, as a Segment does.
+     *
+     * Each lookup is a single probe, while each table takes a binary search,
+     * and both slow down as the hashes outgrow the caches. A search touches
+     * every table though, so it slows down sooner, and the more hashes there
+     * are the fewer tables it takes for the lookups to win at a distance of
+     * one. Beyond that they hardly ever do.
+     */
+    bool ball_beats_search(size_t count, size_t different_bits, size_t tables);
+
+    /**
+     * Whether looking up each hash within different_bits of every one of
+     * count hashes in a hash table of them all should be cheaper than sorting
+     * and scanning this many permuted tables, as find_matches does.
+     *
+     * Sorting costs a little more per hash as count grows, but the lookups
+     * cost much more once the hash table no longer fits in the caches. So at
+     * a distance of one this takes about 20 tables for tens of thousands of
+     * hashes, and more and more beyond.
+     */
+    bool ball_beats_sort(size_t count, size_t different_bits, size_t tables);
+
+    /**
+     * An open-addressing hash table from each distinct hash to the range of
+     * rows holding it in some array where equal hashes are adjacent.
+     *
+     * Keys are spread over a power-of-two number of slots, at least twice as
+     * many as there are keys, and collisions are resolved by linear probing.
+     * Zero marks an empty slot, so the hash zero is kept aside. There may be
+     * at most 2^32 rows.
+     */
+    class HashTable {
+    public:
+        HashTable();
+
+        /**
+         * Index count rows, where rows holding equal hashes are adjacent.
+         */
+        HashTable(const hash_t* hashes, size_t count);
+
+        /**
+         * Index count rows, whose hashes are hash_of(row) and where rows
+         * holding equal hashes are adjacent.
+         */
+        template <typename HashOf>
+        HashTable(size_t count, HashOf hash_of)
+            : HashTable()
+        {
+            build(count, hash_of);
+        }
+
+        /**
+         * Whether any row holds this hash.
+         */
+        bool contains(hash_t hash) const
+        {
+            if (!hash) {
+                return zero_.second > zero_.first;
+            }
+            for (size_t slot = slot_of(hash); ; slot = (slot + 1) & mask_) {
+                hash_t key = keys_[slot];
+                if (key == hash) {
+                    return true;
+                }
+                if (!key) {
+                    return false;
+                }
+            }
+        }
+
+        /**
+         * The rows [first, second) that hold this hash, which are empty if
+         * there are none.
+         */
+        std::pair<size_t, size_t> find(hash_t hash) const
+        {
+            if (!hash) {
+                return zero_;
+            }
+            for (size_t slot = slot_of(hash); ; slot = (slot + 1) & mask_) {
+                hash_t key = keys_[slot];
+                if (key == hash) {
+                    return std::make_pair(size_t(begins_[slot]),
+                                          size_t(begins_[slot]) + counts_[slot]);
+                }
+                if (!key) {
+                    return std::make_pair(size_t(0), size_t(0));
+                }
+            }
+        }
+
+    private:
+        size_t slot_of(hash_t hash) const
+        {
+            return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ULL) >> shift_);
+        }
+
+        template <typename HashOf>
+        void build(size_t count, HashOf hash_of);
+
+        /**
+         * Size the table for keys distinct hashes in rows rows.
+         */
+        void reserve(size_t keys, size_t rows);
+
+        void insert(hash_t hash, size_t begin, size_t count);
+
+        std::vector<hash_t> keys_;
+        std::vector<uint32_t> begins_;
+        std::vector<uint32_t> counts_;
+        size_t mask_;
+        int shift_;
+        std::pair<size_t, size_t> zero_;
+    };
+
+    template <typename HashOf>
+    void HashTable::build(size_t count, HashOf hash_of)
+    {
+        size_t keys = 0;
+        for (size_t i = 0; i < count; ++i) {
+            keys += (i == 0 || hash_of(i) != hash_of(i - 1));
+        }
+        reserve(keys, count);
+        for (size_t begin = 0; begin < count; ) {
+            hash_t hash = hash_of(begin);
+            size_t end = begin + 1;
+            while (end < count && hash_of(end) == hash) {
+                ++end;
+            }
+            insert(hash, begin, end - begin);
+            begin = end;
+        }
+    }
+}
+
+#endif
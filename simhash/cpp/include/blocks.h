@@ -0,0 +1,71 @@
+#ifndef SIMHASH_BLOCKS_H
+#define SIMHASH_BLOCKS_H
+
+#include <cstdint>
+#include <vector>
+
+#include "simhash.h"
+#include "permutation.h"
+
+namespace Simhash {
+
+    /**
+     * Pick the number of blocks that should make find_matches fastest on
+     * these hashes, for matches within different_bits.
+     *
+     * More blocks mean longer prefixes and so fewer candidate pairs per
+     * table, but more tables to sort. For every feasible number of blocks, a
+     * sample of the hashes is sorted under a few of its permutations to count
+     * the pairs that share a prefix, which is scaled up to the whole input
+     * and weighed against the cost of sorting each table. Clustered inputs
+     * have far more such pairs than uniform ones, which is why this can't be
+     * decided from the number of hashes alone.
+     */
+    size_t choose_blocks(const hash_t* hashes, size_t count, size_t different_bits);
+
+    size_t choose_blocks(const std::vector<hash_t>& hashes, size_t different_bits);
+
+    /**
+     * The masks of number_of_blocks contiguous blocks that each carry about
+     * the same share of the information in these hashes, from the highest
+     * block down.
+     *
+     * Feature hashing leaves some bits far more predictable than others, so
+     * blocks of equal width can have very different numbers of distinct
+     * values, and a table whose prefix is made of predictable blocks ends up
+     * with a few huge buckets. Here the entropy of each bit is measured on a
+     * sample, and the blocks are cut where the running total crosses each
+     * equal share, so low-entropy stretches get wider blocks.
+     */
+    std::vector<hash_t> balanced_blocks(const hash_t* hashes,
+                                        size_t count,
+                                        size_t number_of_blocks);
+
+    std::vector<hash_t> balanced_blocks(const std::vector<hash_t>& hashes,
+                                        size_t number_of_blocks);
+
+    /**
+     * One permutation for every way to choose different_bits of the blocks
+     * to leave out of the prefix, as Permutation::choose makes for even
+     * blocks. The blocks must be contiguous, disjoint and cover all 64 bits,
+     * in any order.
+     */
+    std::vector<Permutation> permutations_of(std::vector<hash_t> blocks,
+                                             size_t different_bits);
+
+    /**
+     * The number of words layout_of describes a permutation with.
+     */
+    const size_t LAYOUT_WORDS = BITS / 8;
+
+    /**
+     * Describe where a permutation moves every bit, as the destination of
+     * bit i in byte i of LAYOUT_WORDS words, low byte first. Unlike its
+     * search mask, which only records how wide its prefix is, this tells
+     * apart permutations of different blocks of the same widths, so that a
+     * file sorted under one isn't read under another.
+     */
+    void layout_of(const Permutation& permutation, uint64_t* words);
+}
+
+#endif
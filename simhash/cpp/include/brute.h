@@ -0,0 +1,50 @@
+#ifndef SIMHASH_BRUTE_H
+#define SIMHASH_BRUTE_H
+
+#include <vector>
+
+#include "simhash.h"
+#include "permutation.h"
+
+namespace Simhash {
+
+    struct Matches;
+
+    /**
+     * The number of hashes in each tile that find_matches_brute compares
+     * with every other tile, small enough that a pair of tiles stays in L1.
+     */
+    const size_t TILE = 512;
+
+    /**
+     * Add to matches every pair of a hash from a and a hash from b that
+     * differ by at most different_bits bits, with a's hash first. If a and b
+     * are the same tile, each pair within it is compared only once, with
+     * the earlier hash first.
+     *
+     * Pairs are compared several at a time with AVX-512 or AVX2, or else one
+     * at a time with POPCNT, whichever the CPU supports. Since the extension
+     * is built for the baseline instruction set, this is decided when the
+     * process first gets here.
+     */
+    void compare_tiles(const hash_t* a,
+                       size_t a_count,
+                       const hash_t* b,
+                       size_t b_count,
+                       size_t different_bits,
+                       Matches& matches);
+
+    /**
+     * Whether comparing every pair of count hashes should be cheaper than
+     * sorting and scanning a table for each of these permutations.
+     *
+     * Each table costs a sort of the hashes and then a comparison of every
+     * pair sharing its prefix, of which there are more the shorter the
+     * prefix. With a few thousand hashes the sorts are mostly overhead, and
+     * when different_bits is large next to the number of blocks the prefixes
+     * are so short that the tables compare nearly every pair anyway.
+     */
+    bool brute_beats_sort(size_t count, const std::vector<Permutation>& permutations);
+}
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef SIMHASH_COMPUTE_H
+#define SIMHASH_COMPUTE_H
+
+#include <cstdint>
+
+#include "simhash.h"
+#include "pool.h"
+
+namespace Simhash {
+
+    class Stoplist;
+
+    /**
+     * The simhash of count feature hashes, in which each bit is set if it's
+     * set in more than half of them. This gives the same result as compute
+     * on a vector.
+     *
+     * Rather than updating 64 counters for every hash, the hashes are summed
+     * bit-sliced: a word holds one bit of the running count for each of the
+     * 64 positions, and eight hashes at a time are folded into the words of
+     * weight one, two and four with carry-save adders, whose carries ripple
+     * into words of higher weights. That's a few dozen word operations for
+     * every eight hashes, with no branches on their bits, and the counts are
+     * only unpacked at the end.
+     */
+    hash_t compute(const hash_t* hashes, size_t count);
+
+    /**
+     * The simhash of those of count feature hashes that aren't in the
+     * stoplist. They're filtered a batch at a time into a buffer on the stack
+     * and counted from there, so nothing is allocated.
+     */
+    hash_t compute(const hash_t* hashes, size_t count, const Stoplist& stoplist);
+
+    /**
+     * The simhash of each of many documents, whose feature hashes are stored
+     * one after another: document i's are hashes[offsets[i], offsets[i + 1]),
+     * so there are documents + 1 offsets, which must never decrease or pass
+     * count. The simhash of document i is written to results[i].
+     *
+     * The documents are split into a few contiguous runs per thread of the
+     * pool, so that uneven documents still keep every thread busy. A batch
+     * of only a few thousand hashes is computed on the calling thread.
+     */
+    void compute_many(const hash_t* hashes,
+                      size_t count,
+                      const uint64_t* offsets,
+                      size_t documents,
+                      hash_t* results,
+                      Pool& pool);
+
+    /**
+     * Like compute_many, leaving out of every document the hashes that are
+     * in the stoplist.
+     */
+    void compute_many(const hash_t* hashes,
+                      size_t count,
+                      const uint64_t* offsets,
+                      size_t documents,
+                      const Stoplist& stoplist,
+                      hash_t* results,
+                      Pool& pool);
+
+    /**
+     * The simhash of count feature hashes with these weights, in which each
+     * bit is set if the hashes that have it set outweigh those that don't.
+     * With every weight 1, this is compute. Weights may be negative, and
+     * integer weights are summed exactly while the sums stay below 2^53.
+     *
+     * The 64 sums are kept in vector registers and updated four bits at a
+     * time with AVX2 when the CPU supports it, decided when the process first
+     * gets here.
+     */
+    hash_t compute_weighted(const hash_t* hashes, const double* weights, size_t count);
+
+    /**
+     * Like compute_many, for weighted hashes, where document i's weights are
+     * weights[offsets[i], offsets[i + 1]).
+     */
+    void compute_weighted_many(const hash_t* hashes,
+                               const double* weights,
+                               size_t count,
+                               const uint64_t* offsets,
+                               size_t documents,
+                               hash_t* results,
+                               Pool& pool);
+
+    /**
+     * The running sums behind a simhash, so that it can be kept up to date
+     * as features come and go, as over a sliding window, without computing
+     * it again from every feature.
+     *
+     * Each bit's sum goes up by a feature's weight if the feature has the
+     * bit set and down by it otherwise, and the digest has the bits whose
+     * sums are positive. So the digest of the features added and not since
+     * removed is their compute, or with weights their compute_weighted.
+     * Removing a feature that was never added is not an error; it's counted
+     * against the bits like a negative weight.
+     */
+    class Accumulator {
+    public:
+        Accumulator();
+
+        /**
+         * Add one feature hash, in time independent of how many there are.
+         */
+        void add(hash_t hash, int64_t weight = 1);
+
+        /**
+         * Add many feature hashes at once, counted as compute counts them.
+         */
+        void add(const hash_t* hashes, size_t count);
+
+        void remove(hash_t hash, int64_t weight = 1);
+
+        void remove(const hash_t* hashes, size_t count);
+
+        /**
+         * Add all of other's features, as if they'd been added to this.
+         */
+        void merge(const Accumulator& other);
+
+        /**
+         * The simhash of the features added so far.
+         */
+        hash_t digest() const;
+
+    private:
+        int64_t sums_[BITS];
+    };
+}
+
+#endif
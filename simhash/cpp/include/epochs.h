@@ -0,0 +1,86 @@
+#ifndef SIMHASH_EPOCHS_H
+#define SIMHASH_EPOCHS_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+    /**
+     * Epoch-based reclamation of objects that readers may still be using.
+     *
+     * Readers hold a Guard for as long as they use an object they loaded from
+     * a shared pointer. A writer that swaps such a pointer retires the old
+     * object rather than deleting it, and it's deleted once every reader that
+     * might have loaded it has dropped its guard. Readers never wait on
+     * writers; they only contend with each other for a slot, and only when
+     * there are more concurrent readers than slots.
+     */
+    class Epochs {
+    public:
+        Epochs();
+
+        /**
+         * Deletes every retired object. There must be no active guards.
+         */
+        ~Epochs();
+
+        Epochs(const Epochs&) = delete;
+        Epochs& operator=(const Epochs&) = delete;
+
+        /**
+         * Marks the current thread as reading for the lifetime of the guard.
+         * Shared pointers must be loaded only after the guard is constructed.
+         */
+        class Guard {
+        public:
+            explicit Guard(Epochs& epochs);
+            ~Guard();
+
+            Guard(const Guard&) = delete;
+            Guard& operator=(const Guard&) = delete;
+
+        private:
+            std::atomic<uint64_t>& slot_;
+        };
+
+        /**
+         * Hand over an object that has just been unpublished, to be deleted
+         * when no reader can still be using it. Calls to retire must not
+         * overlap.
+         */
+        void retire(std::shared_ptr<const void> object);
+
+    private:
+        static const size_t SLOTS = 128;
+
+        /**
+         * The epoch an active reader entered in, or 0 for a free slot. Padded
+         * to a cache line so that readers don't contend on each other's slots.
+         */
+        struct Slot {
+            std::atomic<uint64_t> epoch;
+            char padding[64 - sizeof(std::atomic<uint64_t>)];
+        };
+
+        /**
+         * Claim a free slot for the current thread.
+         */
+        std::atomic<uint64_t>& enter();
+
+        /**
+         * Delete every retired object that no active reader can be using.
+         */
+        void reclaim();
+
+        std::atomic<uint64_t> epoch_;
+        Slot slots_[SLOTS];
+        std::vector<std::pair<uint64_t, std::shared_ptr<const void> > > retired_;
+    };
+}
+
+#endif
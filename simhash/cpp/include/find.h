@@ -0,0 +1,245 @@
+#ifndef SIMHASH_FIND_H
+#define SIMHASH_FIND_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "simhash.h"
+#include "ball.h"
+#include "brute.h"
+#include "permutation.h"
+#include "pool.h"
+
+namespace Simhash {
+
+    /**
+     * Pairs of matching hashes and the number of bits they differ by, stored
+     * as three parallel columns.
+     */
+    struct Matches {
+        std::vector<hash_t> first;
+        std::vector<hash_t> second;
+        std::vector<uint8_t> distance;
+
+        size_t size() const { return distance.size(); }
+
+        void push_back(hash_t a, hash_t b, size_t bits)
+        {
+            first.push_back(a);
+            second.push_back(b);
+            distance.push_back(static_cast<uint8_t>(bits));
+        }
+
+        /**
+         * Move all of other's matches onto the end of these.
+         */
+        void append(Matches& other);
+    };
+
+    /**
+     * Find every pair of distinct hashes that differ by at most different_bits
+     * bits, along with how many bits they differ by. Each pair is reported
+     * exactly once, with the smaller hash first. Repeated hashes are ignored.
+     *
+     * Each permutation's table is sorted and scanned as its own task on the
+     * pool, so at most one copy of the hashes per thread is held at a time. A
+     * pair is only reported from the first table in which it shares a prefix,
+     * which makes it unnecessary to collect the matches in a set.
+     */
+    Matches find_matches(const std::vector<hash_t>& hashes,
+                         size_t number_of_blocks,
+                         size_t different_bits,
+                         Pool& pool);
+
+    /**
+     * Like find_matches, for count hashes stored contiguously, for instance
+     * in a memory-mapped file.
+     */
+    Matches find_matches(const hash_t* hashes,
+                         size_t count,
+                         size_t number_of_blocks,
+                         size_t different_bits,
+                         Pool& pool);
+
+    /**
+     * Like find_matches, with one table per permutation instead of the
+     * permutations of evenly sized blocks. These must be made for
+     * different_bits, by Permutation::choose or permutations_of. The same
+     * goes for the other functions and classes taking permutations below.
+     */
+    Matches find_matches(const std::vector<hash_t>& hashes,
+                         const std::vector<Permutation>& permutations,
+                         size_t different_bits,
+                         Pool& pool);
+
+    Matches find_matches(const hash_t* hashes,
+                         size_t count,
+                         const std::vector<Permutation>& permutations,
+                         size_t different_bits,
+                         Pool& pool);
+
+    /**
+     * Find every match among the hashes, as find_matches does, by looking up
+     * every hash within different_bits of each one in a hash table of them
+     * all rather than sorting permuted tables. That's ball_size probes per
+     * hash and a single copy of the hashes, which for distances of one or
+     * two can beat sorting every table; find_matches switches to this on its
+     * own when it should.
+     */
+    Matches find_matches_ball(const hash_t* hashes,
+                              size_t count,
+                              size_t different_bits,
+                              Pool& pool);
+
+    /**
+     * Find every match among the hashes, as find_matches does, by comparing
+     * every pair of them. The sorted hashes are cut into tiles, and each
+     * tile is compared with itself and every later tile as one task, so this
+     * stays in cache and needs no copies. For a few thousand hashes, or for
+     * distances so large that every table's prefix is short, this beats
+     * sorting tables; find_matches switches to this on its own when it
+     * should.
+     */
+    Matches find_matches_brute(const hash_t* hashes,
+                               size_t count,
+                               size_t different_bits,
+                               Pool& pool);
+
+    /**
+     * Append matches to a file as MATCH_RECORD_SIZE-byte records, as
+     * find_matches_external writes them.
+     */
+    void append_matches(const std::string& output, const Matches& matches);
+
+    /**
+     * The size of each match written by find_matches_external: the smaller
+     * and larger hash, each as 8 bytes in native byte order, and then the
+     * number of bits they differ by as a single byte.
+     */
+    const size_t MATCH_RECORD_SIZE = 17;
+
+    /**
+     * Find every match among the hashes in a file, as find_matches does, for
+     * inputs too large to hold in memory. The input holds raw 64-bit hashes
+     * in native byte order, and the matches are appended to output as
+     * MATCH_RECORD_SIZE-byte records. Returns the number of matches.
+     *
+     * One table at a time, the input is read in chunks that together take
+     * about memory bytes, and each chunk is permuted, sorted and written to
+     * directory as a run, one chunk per task on the pool. While there are
+     * more runs than fit in one merge, at most 64 and fewer when memory is
+     * small, they are merged a group at a time into longer runs. The rest
+     * are merged in a final streaming pass, and each group of hashes sharing
+     * a prefix is scanned as it goes by, so only one group has to be held at
+     * a time. The runs are removed afterwards, and the directory must not be
+     * used by any other call at the same time.
+     */
+    size_t find_matches_external(const std::string& input,
+                                 const std::string& output,
+                                 size_t number_of_blocks,
+                                 size_t different_bits,
+                                 size_t memory,
+                                 const std::string& directory,
+                                 Pool& pool);
+
+    size_t find_matches_external(const std::string& input,
+                                 const std::string& output,
+                                 const std::vector<Permutation>& permutations,
+                                 size_t different_bits,
+                                 size_t memory,
+                                 const std::string& directory,
+                                 Pool& pool);
+
+    /**
+     * A corpus of hashes, sorted once into one permuted table per
+     * permutation, so that it can be searched by many batches of queries.
+     *
+     * This takes one copy of the corpus per table, in exchange for each batch
+     * only having to sort itself.
+     */
+    class Tables {
+    public:
+        /**
+         * Sort the unique hashes of the corpus into their tables, one table
+         * per task on the pool.
+         */
+        Tables(const std::vector<hash_t>& hashes,
+               size_t number_of_blocks,
+               size_t different_bits,
+               Pool& pool);
+
+        Tables(const std::vector<hash_t>& hashes,
+               const std::vector<Permutation>& permutations,
+               size_t different_bits,
+               Pool& pool);
+
+        /**
+         * Find every pair of a query and a corpus hash that differ by at most
+         * different_bits bits. Pairs within the queries or within the corpus
+         * are never compared. Each pair is reported exactly once, with the
+         * query first. Repeated queries are ignored.
+         */
+        Matches find(const std::vector<hash_t>& queries, Pool& pool) const;
+
+        /**
+         * Merge new hashes into the corpus, returning every matching pair that
+         * involves at least one of them, smaller hash first. Hashes already
+         * in the corpus aren't new. Together with the matches of the corpus
+         * before, these are exactly what find_matches would return for the
+         * whole of it.
+         *
+         * Only the new hashes are sorted; each table takes a linear merge.
+         */
+        Matches add(const std::vector<hash_t>& hashes, Pool& pool);
+
+        /**
+         * Write each table to its own file, named after the prefix. Each file
+         * holds the table's permuted hashes in sorted order.
+         */
+        void save(const std::string& prefix, Pool& pool) const;
+
+        /**
+         * Replace the corpus with the tables written by save with the same
+         * prefix. They must have been saved with the same blocks, or
+         * permutations, and different_bits.
+         */
+        void load(const std::string& prefix, Pool& pool);
+
+        /**
+         * The number of unique hashes in the corpus.
+         */
+        size_t size() const { return tables_.empty() ? 0 : tables_[0].size(); }
+
+        size_t different_bits() const { return different_bits_; }
+
+    private:
+        /**
+         * The name of the file a table is saved to.
+         */
+        static std::string filename(const std::string& prefix, size_t table);
+
+        size_t different_bits_;
+        std::vector<Permutation> permutations_;
+        std::vector<hash_t> prefixes_;
+        std::vector<std::vector<hash_t> > tables_;
+    };
+
+    /**
+     * Find every pair of a query and a corpus hash that differ by at most
+     * different_bits bits, as Tables::find does, without keeping the tables.
+     */
+    Matches find_between(const std::vector<hash_t>& queries,
+                         const std::vector<hash_t>& corpus,
+                         size_t number_of_blocks,
+                         size_t different_bits,
+                         Pool& pool);
+
+    Matches find_between(const std::vector<hash_t>& queries,
+                         const std::vector<hash_t>& corpus,
+                         const std::vector<Permutation>& permutations,
+                         size_t different_bits,
+                         Pool& pool);
+}
+
+#endif
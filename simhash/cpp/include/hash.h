@@ -0,0 +1,115 @@
+#ifndef SIMHASH_HASH_H
+#define SIMHASH_HASH_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+    /**
+     * Fast, non-cryptographic hashing of features to 64 bits, in the style
+     * of wyhash: the input is read eight bytes at a time and folded into the
+     * state by multiplying to 128 bits and xoring the halves together, so
+     * every input bit reaches every output bit. It's several times faster
+     * than unsigned_hash's MD5, with which it is of course not compatible,
+     * and gives the same hashes on every platform.
+     */
+    namespace Hash {
+
+        const uint64_t SECRET0 = 0x2d358dccaa6c78a5ULL;
+        const uint64_t SECRET1 = 0x8bb84b93962eacc9ULL;
+        const uint64_t SECRET2 = 0x4b33a62ed433d4a3ULL;
+        const uint64_t SECRET3 = 0x4d5a2da51de1aa47ULL;
+
+        /**
+         * Multiply a and b to 128 bits, leaving the low half in a and the
+         * high half in b.
+         */
+        inline void multiply(uint64_t& a, uint64_t& b)
+        {
+            __uint128_t product = static_cast<__uint128_t>(a) * b;
+            a = static_cast<uint64_t>(product);
+            b = static_cast<uint64_t>(product >> 64);
+        }
+
+        inline uint64_t mix(uint64_t a, uint64_t b)
+        {
+            multiply(a, b);
+            return a ^ b;
+        }
+
+        inline uint64_t read64(const unsigned char* p)
+        {
+            uint64_t result;
+            std::memcpy(&result, p, sizeof(result));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            result = __builtin_bswap64(result);
+#endif
+            return result;
+        }
+
+        inline uint64_t read32(const unsigned char* p)
+        {
+            uint32_t result;
+            std::memcpy(&result, p, sizeof(result));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            result = __builtin_bswap32(result);
+#endif
+            return result;
+        }
+    }
+
+    /**
+     * The 64-bit hash of size bytes of data, which differs for each seed.
+     */
+    inline hash_t hash_bytes(const void* data, size_t size, uint64_t seed = 0)
+    {
+        using namespace Hash;
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        seed ^= mix(seed ^ SECRET0, SECRET1);
+        uint64_t a;
+        uint64_t b;
+        if (size <= 16) {
+            if (size >= 4) {
+                size_t middle = (size >> 3) << 2;
+                a = (read32(p) << 32) | read32(p + middle);
+                b = (read32(p + size - 4) << 32) | read32(p + size - 4 - middle);
+            } else if (size > 0) {
+                a = (uint64_t(p[0]) << 16) | (uint64_t(p[size >> 1]) << 8) | p[size - 1];
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t left = size;
+            if (left >= 48) {
+                // Three independent lanes, so the multiplies can overlap.
+                uint64_t second = seed;
+                uint64_t third = seed;
+                do {
+                    seed = mix(read64(p) ^ SECRET1, read64(p + 8) ^ seed);
+                    second = mix(read64(p + 16) ^ SECRET2, read64(p + 24) ^ second);
+                    third = mix(read64(p + 32) ^ SECRET3, read64(p + 40) ^ third);
+                    p += 48;
+                    left -= 48;
+                } while (left >= 48);
+                seed ^= second ^ third;
+            }
+            while (left > 16) {
+                seed = mix(read64(p) ^ SECRET1, read64(p + 8) ^ seed);
+                p += 16;
+                left -= 16;
+            }
+            a = read64(p + left - 16);
+            b = read64(p + left - 8);
+        }
+        a ^= SECRET1;
+        b ^= seed;
+        multiply(a, b);
+        return mix(a ^ SECRET0 ^ size, b ^ SECRET1);
+    }
+}
+
+#endif
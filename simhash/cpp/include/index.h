@@ -0,0 +1,250 @@
+#ifndef SIMHASH_INDEX_H
+#define SIMHASH_INDEX_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "simhash.h"
+#include "permutation.h"
+#include "epochs.h"
+#include "memtable.h"
+#include "pool.h"
+#include "schedule.h"
+#include "segment.h"
+
+namespace Simhash {
+
+    /**
+     * An index of hashes that supports continuous insertion and querying.
+     *
+     * New entries go into a small memtable which is scanned linearly. When it
+     * fills up, it is sealed and a background thread turns it into an
+     * immutable segment with one sorted table per permutation. Segments of
+     * similar size are merged in the background once merge_factor of them
+     * have accumulated, so the number of segments a query has to visit grows
+     * only logarithmically with the size of the index.
+     *
+     * Removed entries are marked in per-segment tombstone bitmaps and skipped
+     * by queries. They're dropped whenever their segment is merged, and a
+     * segment is rewritten on its own once a quarter of it has been removed.
+     *
+     * Writers are serialized, but readers never block. The memtable, sealed
+     * memtables and segments that make up the index are published together
+     * as an immutable version through an atomic pointer, and each query
+     * searches the version it started with. Replaced versions are reclaimed
+     * once no query can still be using them. Removals are the exception, and
+     * become visible to queries already in flight as soon as they're made.
+     *
+     * Segments are built, merged and saved one (table, shard) pair at a
+     * time on a pool of threads, and loaded one table at a time.
+     */
+    class Index {
+    public:
+        /**
+         * Construct an empty index for finding hashes that differ by at most
+         * different_bits bits. Segments are built on this many threads, where
+         * zero means one per core.
+         */
+        Index(size_t number_of_blocks,
+              size_t different_bits,
+              size_t memtable_capacity = 16384,
+              size_t merge_factor = 4,
+              size_t threads = 0);
+
+        /**
+         * Construct an empty index with one table per permutation, which
+         * must be made for different_bits by Permutation::choose or
+         * permutations_of.
+         */
+        Index(const std::vector<Permutation>& permutations,
+              size_t different_bits,
+              size_t memtable_capacity = 16384,
+              size_t merge_factor = 4,
+              size_t threads = 0);
+
+        ~Index();
+
+        Index(const Index&) = delete;
+        Index& operator=(const Index&) = delete;
+
+        /**
+         * Add a hash to the index, under the provided identifier.
+         *
+         * If the background thread has failed to build a segment since the
+         * last time that was reported, this, flush and compact rethrow its
+         * exception instead. The memtables it was building from stay sealed
+         * and searchable, and the next flush or compact tries again.
+         */
+        void insert(hash_t hash, doc_id_t id);
+
+        /**
+         * Remove every copy of an entry from the index, returning how many
+         * there were.
+         */
+        size_t remove(hash_t hash, doc_id_t id);
+
+        /**
+         * Return all the entries within different_bits of query.
+         *
+         * When that's cheaper than searching every table, as it is for
+         * small enough distances, each segment is instead asked for every
+         * hash within different_bits of query directly.
+         */
+        std::vector<entry_t> find(hash_t query) const;
+
+        /**
+         * Return the k entries nearest to query, nearest first, out of those
+         * within max_distance of it. Ties are broken by hash and identifier.
+         *
+         * Tables are searched in batches that settle increasing distances,
+         * so the search stops as soon as the k nearest are known. In
+         * particular, an exact match is found in the first table alone.
+         * Segments look up every hash within max_distance directly instead,
+         * when that's cheaper than searching the tables it takes.
+         */
+        std::vector<neighbor_t> nearest(hash_t query,
+                                        size_t k,
+                                        size_t max_distance) const;
+
+        /**
+         * Seal the memtable and block until it and every other pending
+         * memtable have been turned into segments and merged.
+         */
+        void flush();
+
+        /**
+         * Like flush, but also rewrite every segment with removed entries in
+         * it, so that they no longer take up any memory.
+         */
+        void compact();
+
+        /**
+         * Flush, and then write every segment to the directory, which must
+         * already exist. Each (segment, table) goes to its own file, and a
+         * manifest named "index" lists the segments and their tables' layouts.
+         */
+        void save(const std::string& directory);
+
+        /**
+         * Add the segments saved in the directory to this index. It must have
+         * been saved by an index with the same blocks and different_bits.
+         */
+        void load(const std::string& directory);
+
+        /**
+         * The number of entries in the index.
+         */
+        size_t size() const;
+
+        /**
+         * The number of segments currently in the index.
+         */
+        size_t segments() const;
+
+    private:
+        /**
+         * Everything a query has to search, at one point in time. Only the
+         * live memtable and the tombstones change once a version has been
+         * published.
+         */
+        struct Version {
+            std::shared_ptr<Memtable> memtable;
+            std::vector<std::shared_ptr<Memtable> > sealed;
+            std::vector<Segment::ptr_t> segments;
+        };
+
+        /**
+         * Make a version the current one, and retire the one it replaces.
+         * The caller must hold mutex_.
+         */
+        void publish(std::shared_ptr<const Version> version);
+
+        /**
+         * Move the memtable to the queue of sealed memtables. The caller must
+         * hold mutex_.
+         */
+        void seal();
+
+        /**
+         * Find the positions of the segments to merge next, in increasing
+         * order, or nothing if there's no need to merge. The caller must hold
+         * mutex_.
+         */
+        std::vector<size_t> choose_merge() const;
+
+        /**
+         * Find the position of the next segment that should be rewritten
+         * without its removed entries, or nothing if there's no need. The
+         * caller must hold mutex_.
+         */
+        std::vector<size_t> choose_compaction() const;
+
+        /**
+         * Apply the removals that arrived while a segment was being built to
+         * that segment. The caller must hold mutex_.
+         */
+        void replay_removed(Segment& segment);
+
+        /**
+         * Build one segment from the segments at the provided positions, with
+         * the lock released, and install it in their place. Removals that
+         * arrive during the build are applied to the new segment before it's
+         * installed. The caller must hold the lock.
+         */
+        void rebuild(std::unique_lock<std::mutex>& lock,
+                     const std::vector<size_t>& positions);
+
+        /**
+         * Build the next segment that's due, with the lock released, and
+         * return whether there was one. The caller must hold the lock.
+         */
+        bool work(std::unique_lock<std::mutex>& lock);
+
+        /**
+         * Rethrow the exception the background thread last failed with, if
+         * it hasn't been yet. The caller must hold mutex_.
+         */
+        void rethrow();
+
+        /**
+         * The body of the background thread.
+         */
+        void run();
+
+        /**
+         * The prefix of the files for the i-th segment saved to directory.
+         */
+        static std::string segment_prefix(const std::string& directory, size_t i);
+
+        size_t different_bits_;
+        size_t memtable_capacity_;
+        size_t merge_factor_;
+        std::vector<Permutation> permutations_;
+        std::vector<size_t> coverage_;
+        Pool pool_;
+
+        mutable Epochs epochs_;
+        std::atomic<const Version*> current_;
+
+        // Everything below is only used by writers, under mutex_.
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable idle_;
+        std::shared_ptr<const Version> version_;
+        std::vector<entry_t> removed_;
+        std::exception_ptr failure_;
+        bool building_;
+        bool compacting_;
+        bool busy_;
+        bool stopping_;
+        std::thread worker_;
+    };
+}
+
+#endif
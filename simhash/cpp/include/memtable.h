@@ -0,0 +1,90 @@
+#ifndef SIMHASH_MEMTABLE_H
+#define SIMHASH_MEMTABLE_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "simhash.h"
+#include "tombstones.h"
+
+namespace Simhash {
+
+    /**
+     * The type of the identifiers stored alongside hashes in an index.
+     */
+    typedef uint64_t doc_id_t;
+
+    /**
+     * A hash and the identifier it was inserted with.
+     */
+    typedef std::pair<hash_t, doc_id_t> entry_t;
+
+    /**
+     * An entry and its distance from a query, which sort nearest first.
+     */
+    typedef std::pair<size_t, entry_t> neighbor_t;
+
+    /**
+     * A small, unsorted write buffer of entries.
+     *
+     * Hashes and identifiers are kept in separate arrays so that the linear
+     * scan in find is a tight loop over contiguous hashes. The arrays never
+     * move, and an entry is only counted in size once it's fully written, so
+     * one thread may insert while others call find.
+     */
+    class Memtable {
+    public:
+        /**
+         * Construct an empty memtable that holds at most capacity entries.
+         */
+        explicit Memtable(size_t capacity);
+
+        /**
+         * Append an entry. The memtable must not be full, and calls to insert
+         * must not overlap.
+         */
+        void insert(hash_t hash, doc_id_t id);
+
+        /**
+         * Mark every live copy of an entry as removed, returning how many
+         * there were. This is safe to call while other threads call find.
+         */
+        size_t remove(hash_t hash, doc_id_t id);
+
+        /**
+         * Append every live entry within different_bits of query to results.
+         */
+        void find(hash_t query,
+                  size_t different_bits,
+                  std::vector<entry_t>& results) const;
+
+        /**
+         * Like find, but append each entry along with its distance.
+         */
+        void find(hash_t query,
+                  size_t different_bits,
+                  std::vector<neighbor_t>& results) const;
+
+        /**
+         * The number of entries appended, including removed ones.
+         */
+        size_t size() const { return size_.load(std::memory_order_acquire); }
+        size_t capacity() const { return capacity_; }
+        bool full() const { return size() >= capacity_; }
+
+        const hash_t* hashes() const { return hashes_.get(); }
+        const doc_id_t* ids() const { return ids_.get(); }
+        const Tombstones& dead() const { return dead_; }
+
+    private:
+        size_t capacity_;
+        std::unique_ptr<hash_t[]> hashes_;
+        std::unique_ptr<doc_id_t[]> ids_;
+        std::atomic<size_t> size_;
+        Tombstones dead_;
+    };
+}
+
+#endif
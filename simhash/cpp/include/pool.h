@@ -0,0 +1,98 @@
+#ifndef SIMHASH_POOL_H
+#define SIMHASH_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+    /**
+     * A work-stealing pool of threads for running batches of tasks.
+     *
+     * Each batch is split into contiguous runs, one per thread. A thread
+     * works through its own run from the back, and once that's exhausted,
+     * steals from the front of the others', so uneven tasks still keep every
+     * thread busy.
+     */
+    class Pool {
+    public:
+        /**
+         * Construct a pool that runs tasks on this many threads, including
+         * the one calling run. Zero means one per core.
+         */
+        explicit Pool(size_t threads);
+
+        ~Pool();
+
+        Pool(const Pool&) = delete;
+        Pool& operator=(const Pool&) = delete;
+
+        /**
+         * Call task(i) for every i in [0, count), returning once they've all
+         * completed. If any of them throws, one of the exceptions is rethrown
+         * here. Calls to run from different threads are serialized.
+         */
+        void run(size_t count, const std::function<void(size_t)>& task);
+
+        /**
+         * Call task(begin, end) for a few contiguous runs of [0, count) per
+         * thread, as run does, unless nanoseconds, the caller's estimate of
+         * how long all of them take on one thread, is less than waking the
+         * threads costs. Then task(0, count) is called on this thread alone.
+         */
+        void split(size_t count,
+                   size_t nanoseconds,
+                   const std::function<void(size_t, size_t)>& task);
+
+        /**
+         * The number of threads tasks run on.
+         */
+        size_t threads() const { return queues_.size(); }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<size_t> tasks;
+        };
+
+        /**
+         * Run tasks from the queues, starting with queue, until there are
+         * none left.
+         */
+        void work(size_t queue);
+
+        /**
+         * Take the next task for the provided queue, stealing if need be.
+         */
+        bool next(size_t queue, size_t& task);
+
+        /**
+         * The body of each worker thread.
+         */
+        void loop(size_t queue);
+
+        std::vector<std::unique_ptr<Queue> > queues_;
+        std::vector<std::thread> workers_;
+
+        std::mutex run_mutex_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+        const std::function<void(size_t)>* task_;
+        size_t generation_;
+        size_t remaining_;
+        std::exception_ptr error_;
+        bool stopping_;
+    };
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SIMHASH_SCHEDULE_H
+#define SIMHASH_SCHEDULE_H
+
+#include <vector>
+
+#include "simhash.h"
+#include "permutation.h"
+
+namespace Simhash {
+
+    /**
+     * Reorder permutations so that small distances are settled by the first
+     * few tables.
+     *
+     * A hash within d bits of a query differs from it in at most d blocks, so
+     * it shares a prefix with the query in every table whose leading blocks
+     * avoid those d. Tables are ordered greedily so that the first few cover
+     * every choice of d blocks for d = 0, 1, ... in turn. On return,
+     * coverage[d] is the number of leading tables that are guaranteed to turn
+     * up every hash within d bits of a query, for d up to different_bits.
+     *
+     * Blocks are recovered from the permutations' search masks, so this works
+     * for any layout. If there are too many blocks to enumerate, the order is
+     * left alone and every distance past zero needs every table.
+     */
+    std::vector<size_t> schedule(std::vector<Permutation>& permutations,
+                                 size_t different_bits);
+
+    /**
+     * The fraction of pairs differing in d bits, for each d up to
+     * different_bits, that share a prefix in at least one of these tables,
+     * and so would be found by searching only them. The differing bits are
+     * taken to be equally likely to fall anywhere.
+     *
+     * This is exact, by counting the ways d bits can fall into each set of
+     * blocks, unless there are too many sets to enumerate, in which case it's
+     * estimated from a fixed sample of random choices of bits.
+     */
+    std::vector<double> recall(const std::vector<Permutation>& permutations,
+                               size_t different_bits);
+
+    /**
+     * Whether these tables are sure to find every pair within different_bits,
+     * which holds when there's one for each way to leave different_bits of
+     * their blocks out of the prefix, as Permutation::choose and
+     * permutations_of make them. A subset of those is not, and neither, for
+     * simplicity, is a set with repeated tables.
+     */
+    bool complete(const std::vector<Permutation>& permutations, size_t different_bits);
+
+    /**
+     * The indexes of count of the permutations, picked greedily to maximize
+     * the recall at different_bits, and after that at fewer bits. Searching
+     * only these trades recall for a proportional saving in time.
+     */
+    std::vector<size_t> choose_tables(const std::vector<Permutation>& permutations,
+                                      size_t different_bits,
+                                      size_t count);
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef SIMHASH_SEGMENT_H
+#define SIMHASH_SEGMENT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "simhash.h"
+#include "ball.h"
+#include "permutation.h"
+#include "memtable.h"
+#include "pool.h"
+#include "tombstones.h"
+
+namespace Simhash {
+
+    /**
+     * An immutable run of entries, with one sorted table per permutation.
+     *
+     * Each table holds the permuted hashes in sorted order along with the
+     * position of the entry they came from, so a query only has to compare
+     * against the rows sharing its leading blocks. Removed entries are marked
+     * in a tombstone bitmap, which is the only part of a segment that changes
+     * after it's built; they're dropped when the segment is rewritten.
+     *
+     * Every table is split into SHARDS shards by the leading byte of its
+     * permuted hashes. Each (table, shard) pair is built, sorted and saved as
+     * its own task, and each table is saved to a file of its own.
+     *
+     * The rows of the first table are also indexed by hash, so that a query
+     * for a very small distance can look up every hash that near it directly
+     * instead of searching the tables.
+     */
+    class Segment {
+    public:
+        typedef std::shared_ptr<Segment> ptr_t;
+
+        /**
+         * The number of shards in each table.
+         */
+        static const size_t SHARDS = 256;
+
+        /**
+         * Build a segment from the live contents of a memtable.
+         */
+        Segment(const Memtable& memtable,
+                const std::vector<Permutation>& permutations,
+                Pool& pool);
+
+        /**
+         * Build a single segment from the live entries of several, merging
+         * their sorted tables.
+         */
+        Segment(const std::vector<ptr_t>& segments,
+                const std::vector<Permutation>& permutations,
+                Pool& pool);
+
+        /**
+         * Load a segment written by save with the same prefix.
+         */
+        Segment(const std::string& prefix,
+                const std::vector<Permutation>& permutations,
+                Pool& pool);
+
+        /**
+         * Write the live entries of each table to its own file, named after
+         * the prefix. Each file holds a directory of the row at which each
+         * shard starts, followed by the table's permuted hashes in sorted
+         * order, each followed by its identifier. Each shard's rows are
+         * written in place by a task of their own.
+         */
+        void save(const std::string& prefix, Pool& pool) const;
+
+        /**
+         * Mark every live copy of an entry as removed, returning how many
+         * there were. This is safe to call while other threads call find.
+         */
+        size_t remove(hash_t hash, doc_id_t id);
+
+        /**
+         * Append every live entry within different_bits of query to results.
+         * The same entry may be appended more than once.
+         */
+        void find(hash_t query,
+                  size_t different_bits,
+                  std::vector<entry_t>& results) const;
+
+        /**
+         * Append every live entry within different_bits of query that shares
+         * a prefix with it in tables [begin, end), along with its distance.
+         * The same entry may be appended more than once.
+         */
+        void find(hash_t query,
+                  size_t different_bits,
+                  size_t begin,
+                  size_t end,
+                  std::vector<neighbor_t>& results) const;
+
+        /**
+         * Append every live entry within different_bits of query to results,
+         * as find does, by looking up each hash within different_bits of it.
+         * Each entry is appended once.
+         */
+        void probe(hash_t query,
+                   size_t different_bits,
+                   std::vector<entry_t>& results) const;
+
+        /**
+         * Append every live entry within different_bits of query to results,
+         * along with its distance, by looking up each hash within
+         * different_bits of it. Each entry is appended once.
+         */
+        void probe(hash_t query,
+                   size_t different_bits,
+                   std::vector<neighbor_t>& results) const;
+
+        /**
+         * The number of entries, including removed ones.
+         */
+        size_t size() const { return hashes_.size(); }
+
+        /**
+         * The number of removed entries.
+         */
+        size_t dead() const { return dead_->count(); }
+
+    private:
+        /**
+         * A permuted copy of the segment's hashes, in sorted order. The rows
+         * of shard s are [shards[s], shards[s + 1]).
+         */
+        struct Table {
+            std::vector<hash_t> keys;
+            std::vector<uint32_t> positions;
+            std::vector<size_t> shards;
+        };
+
+        /**
+         * Call emit with the distance and position of every live entry within
+         * different_bits of query in tables [begin, end).
+         */
+        template <typename Emit>
+        void scan(hash_t query,
+                  size_t different_bits,
+                  size_t begin,
+                  size_t end,
+                  Emit emit) const;
+
+        /**
+         * Call emit with the distance and position of every live entry within
+         * different_bits of query, by looking each hash up in by_hash_.
+         */
+        template <typename Emit>
+        void visit(hash_t query, size_t different_bits, Emit emit) const;
+
+        /**
+         * Build the tables from hashes_.
+         */
+        void build(Pool& pool);
+
+        /**
+         * Build by_hash_ from the first table.
+         */
+        void index_hashes();
+
+        /**
+         * The name of the file a table is saved to.
+         */
+        static std::string filename(const std::string& prefix, size_t table);
+
+        const std::vector<Permutation>& permutations_;
+        std::vector<hash_t> hashes_;
+        std::vector<doc_id_t> ids_;
+        std::vector<Table> tables_;
+        HashTable by_hash_;
+        std::unique_ptr<Tombstones> dead_;
+    };
+}
+
+#endif
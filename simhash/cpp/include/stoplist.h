@@ -0,0 +1,108 @@
+#ifndef SIMHASH_STOPLIST_H
+#define SIMHASH_STOPLIST_H
+
+#include <string>
+#include <vector>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+    /**
+     * A set of feature hashes to leave out of simhashes, such as those of
+     * stopwords, or of the shingles of a site's navigation and footers that
+     * would otherwise make all of its pages look alike.
+     *
+     * The hashes are kept in an open-addressing table with linear probing,
+     * at most half full, in which 0 marks an empty slot and is kept aside.
+     * The table can be saved to a file and mapped straight back into memory,
+     * so a large stoplist loads instantly and is shared between processes.
+     * Once built or loaded, one can be read by any number of threads.
+     */
+    class Stoplist {
+    public:
+        /**
+         * An empty stoplist.
+         */
+        Stoplist();
+
+        Stoplist(const hash_t* hashes, size_t count);
+
+        ~Stoplist();
+
+        Stoplist(const Stoplist&) = delete;
+        Stoplist& operator=(const Stoplist&) = delete;
+
+        bool contains(hash_t hash) const
+        {
+            if (hash == 0) {
+                return zero_;
+            }
+            // Bounded, so that a corrupt file can't make this spin.
+            size_t slot = home(hash);
+            for (size_t probes = 0; probes <= mask_; ++probes) {
+                hash_t found = slots_[slot];
+                if (found == hash) {
+                    return true;
+                }
+                if (found == 0) {
+                    return false;
+                }
+                slot = (slot + 1) & mask_;
+            }
+            return false;
+        }
+
+        /**
+         * Copy the count hashes that aren't in this stoplist to kept, in
+         * order, and return how many there were. Kept may be hashes itself.
+         */
+        size_t filter(const hash_t* hashes, size_t count, hash_t* kept) const;
+
+        /**
+         * Save the table to a file, in native byte order.
+         */
+        void save(const std::string& path) const;
+
+        /**
+         * Replace this stoplist with the one saved at path, mapped read-only
+         * into memory rather than read.
+         */
+        void load(const std::string& path);
+
+        /**
+         * The number of hashes in the stoplist, counting 0.
+         */
+        size_t size() const { return size_ + zero_; }
+
+    private:
+        static const hash_t MULTIPLIER = 0x9E3779B97F4A7C15ULL;
+
+        /**
+         * The slot at which the search for a hash starts.
+         */
+        size_t home(hash_t hash) const
+        {
+            return static_cast<size_t>((hash * MULTIPLIER) >> shift_);
+        }
+
+        /**
+         * Point the table at count slots, a power of two, holding size
+         * hashes besides 0.
+         */
+        void use(const hash_t* slots, size_t count, size_t size, bool zero);
+
+        void unmap();
+
+        std::vector<hash_t> owned_;
+        void* mapping_;
+        size_t mapped_bytes_;
+        const hash_t* slots_;
+        size_t mask_;
+        unsigned shift_;
+        size_t size_;
+        bool zero_;
+    };
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef SIMHASH_TEXT_H
+#define SIMHASH_TEXT_H
+
+#include <string>
+#include <vector>
+
+#include "simhash.h"
+#include "compute.h"
+#include "pool.h"
+
+namespace Simhash {
+
+    /**
+     * Splits UTF-8 text into normalized tokens and hashes them.
+     *
+     * A token is a run of letters and digits of any script. Whitespace,
+     * punctuation and symbols separate tokens, and each CJK ideograph is a
+     * token of its own, since those scripts don't put spaces between words.
+     * Latin, Greek, Cyrillic and Armenian letters are case folded, and
+     * fullwidth letters and digits and the decimal digits of other scripts
+     * are read as ASCII. With mask_numbers, every digit is read as 0, so that
+     * dates, prices and counts don't tell otherwise identical texts apart.
+     * A byte that isn't part of valid UTF-8 is kept in its token as it is.
+     *
+     * Each token is hashed with hash_bytes of its normalized UTF-8, so an
+     * ASCII token's hash is that of it lowercased. One can be used by one
+     * thread at a time.
+     */
+    class Tokenizer {
+    public:
+        explicit Tokenizer(bool mask_numbers = false);
+
+        /**
+         * Append the hash of each token of size bytes of text to tokens. This
+         * never allocates beyond growing tokens and the buffer each token is
+         * normalized into.
+         */
+        void tokenize(const char* text, size_t size, std::vector<hash_t>& tokens);
+
+    private:
+        bool mask_numbers_;
+        std::string buffer_;
+    };
+
+    /**
+     * Append the hash of each run of window consecutive token hashes to
+     * shingles, or if there are fewer tokens than that, the hash of them
+     * all, so that short texts still have a feature.
+     *
+     * A shingle's hash is the polynomial t[0] P^(w-1) + ... + t[w-1] in
+     * some odd P, modulo 2^64, finished with a multiply-and-fold that also
+     * takes in w. The window is rolled along the tokens, taking in one and
+     * dropping another, so every shingle costs the same however wide it is.
+     */
+    void shingle(const hash_t* tokens,
+                 size_t count,
+                 size_t window,
+                 std::vector<hash_t>& shingles);
+
+    /**
+     * Like shingle, for several window sizes in one pass over the tokens.
+     * Windows longer than the tokens count as one window of them all, which
+     * is appended only once.
+     *
+     * The polynomial of every prefix of the tokens is kept for as far back
+     * as the longest window, so each shingle is the difference of two of
+     * them, and costs the same however many tokens it spans.
+     */
+    void shingle(const hash_t* tokens,
+                 size_t count,
+                 const std::vector<size_t>& windows,
+                 std::vector<hash_t>& shingles);
+
+    /**
+     * Append the hash of each run of n consecutive characters of size bytes
+     * of UTF-8 text to ngrams, or if there are fewer than that, the hash of
+     * them all. This suits texts too short for shingles of tokens, and
+     * scripts that don't separate words with spaces.
+     *
+     * Characters are decoded from UTF-8, with any byte that doesn't decode
+     * taken as a character of its own. ASCII letters are lowercased and each
+     * run of whitespace is read as one space, ignoring it at either end.
+     * The hashes are rolled along the text as shingle rolls them along the
+     * tokens, with the character leaving each n-gram decoded again, so the
+     * text is only ever read and nothing is allocated besides ngrams.
+     */
+    void char_ngrams(const char* text,
+                     size_t size,
+                     size_t n,
+                     std::vector<hash_t>& ngrams);
+
+    /**
+     * Add the hashes of the n-grams char_ngrams would append straight to the
+     * accumulator, in batches that never leave the stack.
+     */
+    void char_ngrams(const char* text,
+                     size_t size,
+                     size_t n,
+                     Accumulator& accumulator);
+
+    /**
+     * Simhashes of texts, by tokenizing them, hashing the shingles of
+     * window tokens and computing the simhash of those, all without copying
+     * any of them out of the buffers it reuses between texts. One can be
+     * used by one thread at a time.
+     */
+    class Fingerprinter {
+    public:
+        explicit Fingerprinter(size_t window, bool mask_numbers = false);
+
+        hash_t fingerprint(const char* text, size_t size);
+
+    private:
+        size_t window_;
+        Tokenizer tokenizer_;
+        std::vector<hash_t> tokens_;
+        std::vector<hash_t> shingles_;
+    };
+
+    /**
+     * The fingerprint of each of count texts, where text i is sizes[i] bytes
+     * at texts[i], written to results[i]. Each thread of the pool works
+     * through its own runs of texts with its own Fingerprinter, unless there
+     * are only a few kilobytes of text, which the calling thread does alone.
+     */
+    void fingerprint_many(const char* const* texts,
+                          const size_t* sizes,
+                          size_t count,
+                          size_t window,
+                          bool mask_numbers,
+                          hash_t* results,
+                          Pool& pool);
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SIMHASH_TOMBSTONES_H
+#define SIMHASH_TOMBSTONES_H
+
+#include <atomic>
+#include <memory>
+
+#include "simhash.h"
+
+namespace Simhash {
+
+    /**
+     * A fixed-size bitmap of removed positions.
+     *
+     * Bits are only ever set, and are set atomically, so a bitmap may be
+     * updated while other threads are reading it.
+     */
+    class Tombstones {
+    public:
+        explicit Tombstones(size_t size);
+
+        /**
+         * Mark a position as removed. Returns true if it wasn't already.
+         */
+        bool set(size_t position);
+
+        /**
+         * Whether a position has been removed.
+         */
+        bool test(size_t position) const
+        {
+            return (words_[position / 64].load(std::memory_order_relaxed) >>
+                    (position % 64)) & 1;
+        }
+
+        /**
+         * The number of removed positions.
+         */
+        size_t count() const { return count_.load(std::memory_order_relaxed); }
+
+        size_t size() const { return size_; }
+
+    private:
+        size_t size_;
+        std::unique_ptr<std::atomic<uint64_t>[]> words_;
+        std::atomic<size_t> count_;
+    };
+}
+
+#endif
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#include "ball.h"
+
+namespace {
+    using Simhash::hash_t;
+
+    /**
+     * The relative costs of moving one hash through one level of a sort, as
+     * brute_beats_sort has them, of one level of a binary search, and of a
+     * hash table probe, while what they touch fits in the caches. These were
+     * measured against sorting and scanning tables with find_matches and
+     * searching them as a Segment does, from ten thousand to a few million
+     * hashes.
+     */
+    const double SORT_COST = 1.0;
+    const double SEARCH_COST = 1.2;
+    const double PROBE_COST = 4.7;
+
+    /**
+     * Past CACHED_BYTES, more and more random accesses miss the caches and
+     * then the TLB, and each costs this much more with every doubling.
+     */
+    const double CACHED_BYTES = 4 << 20;
+    const double SLOWDOWN_PER_DOUBLING = 0.3;
+
+    /**
+     * The number of shards a Segment splits each table into by leading byte,
+     * only one of which a search has to cover.
+     */
+    const double SEARCH_SHARDS = 256;
+
+    /**
+     * How many times more a random access costs into this many bytes than
+     * into the caches.
+     */
+    double slowdown(double bytes)
+    {
+        return 1 + SLOWDOWN_PER_DOUBLING * std::max(0.0, std::log2(bytes / CACHED_BYTES));
+    }
+
+    /**
+     * The cost of one probe of a HashTable of count hashes, sized as it
+     * sizes itself.
+     */
+    double probe_cost(size_t count)
+    {
+        double slots = 2;
+        while (slots < 2.0 * count) {
+            slots *= 2;
+        }
+        return PROBE_COST * slowdown(slots * (sizeof(hash_t) + 2 * sizeof(uint32_t)));
+    }
+}
+
+size_t Simhash::ball_size(size_t different_bits)
+{
+    size_t result = 0;
+    size_t choose = 1;
+    for (size_t d = 0; d <= different_bits && d <= BITS; ++d) {
+        if (result > SIZE_MAX - choose) {
+            return SIZE_MAX;
+        }
+        result += choose;
+        if (d < BITS && choose > SIZE_MAX / (BITS - d)) {
+            return SIZE_MAX;
+        }
+        choose = choose * (BITS - d) / (d + 1);
+    }
+    return result;
+}
+
+bool Simhash::ball_beats_search(size_t count, size_t different_bits, size_t tables)
+{
+    if (different_bits >= BITS) {
+        return false;
+    }
+    double n = static_cast<double>(count);
+    double search = tables * std::log2(n / SEARCH_SHARDS + 1) * SEARCH_COST *
+        slowdown(tables * n * sizeof(hash_t));
+    return ball_size(different_bits) * probe_cost(count) < search;
+}
+
+bool Simhash::ball_beats_sort(size_t count, size_t different_bits, size_t tables)
+{
+    if (different_bits >= BITS) {
+        return false;
+    }
+    // Both sides are per hash, since either way every hash takes its turn.
+    double sort = tables * std::log2(static_cast<double>(count) + 1) * SORT_COST;
+    return ball_size(different_bits) * probe_cost(count) < sort;
+}
+
+Simhash::HashTable::HashTable()
+    : keys_()
+    , begins_()
+    , counts_()
+    , mask_(0)
+    , shift_(64)
+    , zero_(0, 0)
+{
+}
+
+Simhash::HashTable::HashTable(const Simhash::hash_t* hashes, size_t count)
+    : HashTable()
+{
+    build(count, [hashes](size_t i) { return hashes[i]; });
+}
+
+void Simhash::HashTable::reserve(size_t keys, size_t rows)
+{
+    if (rows > UINT32_MAX) {
+        throw std::length_error("Too many rows for a hash table");
+    }
+    size_t slots = 2;
+    int bits = 1;
+    while (slots < keys * 2) {
+        slots *= 2;
+        ++bits;
+    }
+    keys_.assign(slots, 0);
+    begins_.assign(slots, 0);
+    counts_.assign(slots, 0);
+    mask_ = slots - 1;
+    shift_ = 64 - bits;
+}
+
+void Simhash::HashTable::insert(Simhash::hash_t hash, size_t begin, size_t count)
+{
+    if (!hash) {
+        zero_ = std::make_pair(begin, begin + count);
+        return;
+    }
+    size_t slot = slot_of(hash);
+    while (keys_[slot]) {
+        slot = (slot + 1) & mask_;
+    }
+    keys_[slot] = hash;
+    begins_[slot] = static_cast<uint32_t>(begin);
+    counts_[slot] = static_cast<uint32_t>(count);
+}
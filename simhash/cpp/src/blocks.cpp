@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+
+#include "blocks.h"
+
+namespace {
+    /**
+     * The most hashes sampled.
+     */
+    const size_t SAMPLE = 1 << 14;
+
+    /**
+     * The most permutations sampled for each number of blocks.
+     */
+    const size_t SAMPLED_TABLES = 16;
+
+    /**
+     * Past this many tables, more blocks are never worth it.
+     */
+    const double MAX_TABLES = 4096;
+
+    /**
+     * The relative costs of moving one hash through one level of a sort, and
+     * of comparing one candidate pair.
+     */
+    const double SORT_COST = 1.0;
+    const double COMPARE_COST = 0.75;
+
+    /**
+     * The unique hashes of an evenly strided sample of at most SAMPLE hashes,
+     * in sorted order.
+     */
+    std::vector<Simhash::hash_t> sample_of(const Simhash::hash_t* hashes, size_t count)
+    {
+        std::vector<Simhash::hash_t> sample;
+        size_t step = std::max(count / SAMPLE, size_t(1));
+        for (size_t i = 0; i < count; i += step) {
+            sample.push_back(hashes[i]);
+        }
+        std::sort(sample.begin(), sample.end());
+        sample.erase(std::unique(sample.begin(), sample.end()), sample.end());
+        return sample;
+    }
+
+    /**
+     * The entropy in bits of a bit that is set with this probability.
+     */
+    double entropy(double p)
+    {
+        if (p <= 0 || p >= 1) {
+            return 0;
+        }
+        return -p * std::log2(p) - (1 - p) * std::log2(1 - p);
+    }
+
+    /**
+     * A mask of bits [low, high).
+     */
+    Simhash::hash_t range_mask(size_t low, size_t high)
+    {
+        size_t width = high - low;
+        Simhash::hash_t ones = width == 64 ? ~Simhash::hash_t(0) : (Simhash::hash_t(1) << width) - 1;
+        return ones << low;
+    }
+}
+
+size_t Simhash::choose_blocks(const std::vector<Simhash::hash_t>& hashes,
+                              size_t different_bits)
+{
+    return choose_blocks(hashes.data(), hashes.size(), different_bits);
+}
+
+size_t Simhash::choose_blocks(const Simhash::hash_t* hashes,
+                              size_t count,
+                              size_t different_bits)
+{
+    if (different_bits >= 64) {
+        throw std::invalid_argument("There must be fewer than 64 different bits");
+    }
+
+    std::vector<hash_t> sample = sample_of(hashes, count);
+
+    double n = static_cast<double>(count);
+    double s = static_cast<double>(sample.size());
+    double sort = n * std::log2(n + 1) * SORT_COST;
+
+    size_t best = different_bits + 1;
+    double best_cost = std::numeric_limits<double>::infinity();
+    for (size_t blocks = different_bits + 1; blocks <= 64; ++blocks) {
+        // The number of tables is blocks choose different_bits, and it only
+        // grows, so once sorting them alone costs more than the best so far,
+        // nothing after can be any better.
+        double tables = 1;
+        for (size_t i = 0; i < different_bits; ++i) {
+            tables = tables * static_cast<double>(blocks - i) / static_cast<double>(i + 1);
+        }
+        if (blocks > different_bits + 1 &&
+            (tables > MAX_TABLES || tables * sort >= best_cost)) {
+            break;
+        }
+
+        std::vector<Permutation> permutations = Permutation::choose(blocks, different_bits);
+        size_t sampled = std::min(permutations.size(), SAMPLED_TABLES);
+        double pairs = 0;
+        for (size_t j = 0; j < sampled; ++j) {
+            const Permutation& permutation = permutations[j * permutations.size() / sampled];
+            hash_t mask = permutation.search_mask();
+            std::vector<hash_t> keys(sample.size());
+            for (size_t i = 0; i < sample.size(); ++i) {
+                keys[i] = permutation.apply(sample[i]) & mask;
+            }
+            std::sort(keys.begin(), keys.end());
+
+            // Pairs sharing a prefix in the sample, scaled up to the input,
+            // but never fewer than uniformly random hashes would have.
+            double shared = 0;
+            for (size_t start = 0; start < keys.size(); ) {
+                size_t end = start + 1;
+                while (end < keys.size() && keys[end] == keys[start]) {
+                    ++end;
+                }
+                double run = static_cast<double>(end - start);
+                shared += run * (run - 1) / 2;
+                start = end;
+            }
+            double scaled = s > 1 ? shared * n * (n - 1) / (s * (s - 1)) : 0;
+            double uniform = n * (n - 1) / 2 /
+                std::ldexp(1.0, __builtin_popcountll(mask));
+            pairs += std::max(scaled, uniform);
+        }
+        pairs /= static_cast<double>(sampled);
+
+        double cost = tables * (sort + pairs * COMPARE_COST);
+        if (cost < best_cost) {
+            best = blocks;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+std::vector<Simhash::hash_t> Simhash::balanced_blocks(
+    const std::vector<Simhash::hash_t>& hashes, size_t number_of_blocks)
+{
+    return balanced_blocks(hashes.data(), hashes.size(), number_of_blocks);
+}
+
+std::vector<Simhash::hash_t> Simhash::balanced_blocks(const Simhash::hash_t* hashes,
+                                                      size_t count,
+                                                      size_t number_of_blocks)
+{
+    if (number_of_blocks == 0 || number_of_blocks > BITS) {
+        throw std::invalid_argument("Number of blocks must be between 1 and 64");
+    }
+    std::vector<hash_t> sample = sample_of(hashes, count);
+
+    // total[j] is the entropy of the highest j bits.
+    std::vector<double> total(BITS + 1, 0);
+    for (size_t j = 0; j < BITS; ++j) {
+        size_t bit = BITS - 1 - j;
+        size_t set = 0;
+        for (auto it = sample.begin(); it != sample.end(); ++it) {
+            set += (*it >> bit) & 1;
+        }
+        double p = sample.empty() ? 0.5 :
+            static_cast<double>(set) / static_cast<double>(sample.size());
+        total[j + 1] = total[j] + entropy(p);
+    }
+    if (total[BITS] <= 0) {
+        // With nothing to go on, every bit counts the same.
+        for (size_t j = 0; j <= BITS; ++j) {
+            total[j] = static_cast<double>(j);
+        }
+    }
+
+    // Each cut goes where the running total comes closest to its share,
+    // leaving at least one bit for every block.
+    std::vector<hash_t> blocks;
+    size_t start = 0;
+    for (size_t i = 1; i <= number_of_blocks; ++i) {
+        double target = total[BITS] * static_cast<double>(i) /
+            static_cast<double>(number_of_blocks);
+        size_t last = BITS - (number_of_blocks - i);
+        size_t cut = start + 1;
+        for (size_t j = cut + 1; j <= last; ++j) {
+            if (std::fabs(total[j] - target) < std::fabs(total[cut] - target)) {
+                cut = j;
+            }
+        }
+        blocks.push_back(range_mask(BITS - cut, BITS - start));
+        start = cut;
+    }
+    return blocks;
+}
+
+std::vector<Simhash::Permutation> Simhash::permutations_of(std::vector<Simhash::hash_t> blocks,
+                                                          size_t different_bits)
+{
+    if (blocks.size() <= different_bits) {
+        throw std::invalid_argument("Number of blocks must exceed different_bits");
+    }
+    hash_t covered = 0;
+    for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+        hash_t mask = *it;
+        hash_t shifted = mask ? mask >> __builtin_ctzll(mask) : 0;
+        if (!mask || (shifted & (shifted + 1))) {
+            throw std::invalid_argument("Each block must be a contiguous range of bits");
+        }
+        if (covered & mask) {
+            throw std::invalid_argument("Blocks must not overlap");
+        }
+        covered |= mask;
+    }
+    if (covered != ~hash_t(0)) {
+        throw std::invalid_argument("Blocks must cover all 64 bits");
+    }
+
+    // Enumerated from the highest block down, as Permutation::choose does.
+    std::sort(blocks.begin(), blocks.end(), std::greater<hash_t>());
+    std::vector<Permutation> results;
+    std::vector<bool> select(blocks.size(), false);
+    std::fill(select.begin(), select.begin() + (blocks.size() - different_bits), true);
+    do {
+        std::vector<hash_t> masks;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            if (select[i]) {
+                masks.push_back(blocks[i]);
+            }
+        }
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            if (!select[i]) {
+                masks.push_back(blocks[i]);
+            }
+        }
+        results.push_back(Permutation(different_bits, masks));
+    } while (std::prev_permutation(select.begin(), select.end()));
+    return results;
+}
+
+void Simhash::layout_of(const Simhash::Permutation& permutation, uint64_t* words)
+{
+    std::fill(words, words + LAYOUT_WORDS, 0);
+    for (size_t bit = 0; bit < BITS; ++bit) {
+        uint64_t to = __builtin_ctzll(permutation.apply(hash_t(1) << bit));
+        words[bit / 8] |= to << (8 * (bit % 8));
+    }
+}
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SIMHASH_X86 1
+#endif
+
+#include "brute.h"
+#include "find.h"
+
+namespace {
+    using Simhash::hash_t;
+
+    /**
+     * The relative costs of moving one hash through one level of a sort, and
+     * of comparing one candidate pair that shares a prefix, as choose_blocks
+     * has them.
+     */
+    const double SORT_COST = 1.0;
+    const double COMPARE_COST = 0.75;
+
+    /**
+     * A way to compare two tiles, and the relative cost of each pair it
+     * compares. Brute force is branch-free and runs over memory in cache, so
+     * even one pair at a time it's several times cheaper than a candidate
+     * pair in a table.
+     */
+    struct Kernel {
+        void (*compare)(const hash_t*, size_t, const hash_t*, size_t, size_t,
+                        Simhash::Matches&);
+        double cost;
+    };
+
+    /**
+     * The first column of b to compare with row i of a, which in a tile
+     * compared with itself is the one just after it.
+     */
+    inline size_t first_column(const hash_t* a, const hash_t* b, size_t i)
+    {
+        return (a == b) ? i + 1 : 0;
+    }
+
+    /**
+     * Compare rows [begin, a_count) of a with b one pair at a time. Forced
+     * inline so that each kernel below gets a copy built for its own
+     * instruction set.
+     */
+    inline __attribute__((always_inline))
+    void compare_each(const hash_t* a,
+                      size_t begin,
+                      size_t a_count,
+                      const hash_t* b,
+                      size_t b_count,
+                      size_t different_bits,
+                      Simhash::Matches& matches)
+    {
+        for (size_t i = begin; i < a_count; ++i) {
+            hash_t hash = a[i];
+            for (size_t j = first_column(a, b, i); j < b_count; ++j) {
+                size_t bits = __builtin_popcountll(hash ^ b[j]);
+                if (bits <= different_bits) {
+                    matches.push_back(hash, b[j], bits);
+                }
+            }
+        }
+    }
+
+    void compare_generic(const hash_t* a,
+                         size_t a_count,
+                         const hash_t* b,
+                         size_t b_count,
+                         size_t different_bits,
+                         Simhash::Matches& matches)
+    {
+        compare_each(a, 0, a_count, b, b_count, different_bits, matches);
+    }
+
+#ifdef SIMHASH_X86
+    __attribute__((target("popcnt")))
+    void compare_popcnt(const hash_t* a,
+                        size_t a_count,
+                        const hash_t* b,
+                        size_t b_count,
+                        size_t different_bits,
+                        Simhash::Matches& matches)
+    {
+        compare_each(a, 0, a_count, b, b_count, different_bits, matches);
+    }
+
+    /**
+     * Compare four rows of a with four hashes of b at a time, counting the
+     * bits of each difference with a nibble lookup table and summing the
+     * bytes of each word. Every load of b serves all four rows, and only the
+     * rare blocks holding a close pair leave the vector registers.
+     */
+    __attribute__((target("avx2,popcnt")))
+    void compare_avx2(const hash_t* a,
+                      size_t a_count,
+                      const hash_t* b,
+                      size_t b_count,
+                      size_t different_bits,
+                      Simhash::Matches& matches)
+    {
+        const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i limit = _mm256_set1_epi64x(static_cast<long long>(different_bits) + 1);
+
+        size_t i = 0;
+        for (; i + 4 <= a_count; i += 4) {
+            __m256i rows[4];
+            for (size_t r = 0; r < 4; ++r) {
+                rows[r] = _mm256_set1_epi64x(static_cast<long long>(a[i + r]));
+            }
+            size_t j = first_column(a, b, i);
+            for (; j + 4 <= b_count; j += 4) {
+                __m256i column = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+                __m256i near[4];
+                for (size_t r = 0; r < 4; ++r) {
+                    __m256i x = _mm256_xor_si256(rows[r], column);
+                    __m256i nibbles = _mm256_add_epi8(
+                        _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low)),
+                        _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi64(x, 4), low)));
+                    near[r] = _mm256_cmpgt_epi64(limit, _mm256_sad_epu8(nibbles, zero));
+                }
+                __m256i any = _mm256_or_si256(_mm256_or_si256(near[0], near[1]),
+                                              _mm256_or_si256(near[2], near[3]));
+                if (_mm256_testz_si256(any, any)) {
+                    continue;
+                }
+                for (size_t r = 0; r < 4; ++r) {
+                    int lanes = _mm256_movemask_pd(_mm256_castsi256_pd(near[r]));
+                    for (; lanes; lanes &= lanes - 1) {
+                        size_t k = j + __builtin_ctz(lanes);
+                        if (k >= first_column(a, b, i + r)) {
+                            matches.push_back(a[i + r], b[k], __builtin_popcountll(a[i + r] ^ b[k]));
+                        }
+                    }
+                }
+            }
+            for (size_t r = 0; r < 4; ++r) {
+                for (size_t k = std::max(j, first_column(a, b, i + r)); k < b_count; ++k) {
+                    size_t bits = __builtin_popcountll(a[i + r] ^ b[k]);
+                    if (bits <= different_bits) {
+                        matches.push_back(a[i + r], b[k], bits);
+                    }
+                }
+            }
+        }
+        compare_each(a, i, a_count, b, b_count, different_bits, matches);
+    }
+
+    /**
+     * Compare four rows of a with eight hashes of b at a time, with AVX-512's
+     * own population count.
+     */
+    __attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+    void compare_avx512(const hash_t* a,
+                        size_t a_count,
+                        const hash_t* b,
+                        size_t b_count,
+                        size_t different_bits,
+                        Simhash::Matches& matches)
+    {
+        const __m512i limit = _mm512_set1_epi64(static_cast<long long>(different_bits));
+
+        size_t i = 0;
+        for (; i + 4 <= a_count; i += 4) {
+            __m512i rows[4];
+            for (size_t r = 0; r < 4; ++r) {
+                rows[r] = _mm512_set1_epi64(static_cast<long long>(a[i + r]));
+            }
+            size_t j = first_column(a, b, i);
+            for (; j + 8 <= b_count; j += 8) {
+                __m512i column = _mm512_loadu_si512(b + j);
+                __mmask8 near[4];
+                for (size_t r = 0; r < 4; ++r) {
+                    __m512i counts = _mm512_popcnt_epi64(_mm512_xor_si512(rows[r], column));
+                    near[r] = _mm512_cmple_epu64_mask(counts, limit);
+                }
+                if (!(near[0] | near[1] | near[2] | near[3])) {
+                    continue;
+                }
+                for (size_t r = 0; r < 4; ++r) {
+                    for (unsigned lanes = near[r]; lanes; lanes &= lanes - 1) {
+                        size_t k = j + __builtin_ctz(lanes);
+                        if (k >= first_column(a, b, i + r)) {
+                            matches.push_back(a[i + r], b[k], __builtin_popcountll(a[i + r] ^ b[k]));
+                        }
+                    }
+                }
+            }
+            for (size_t r = 0; r < 4; ++r) {
+                for (size_t k = std::max(j, first_column(a, b, i + r)); k < b_count; ++k) {
+                    size_t bits = __builtin_popcountll(a[i + r] ^ b[k]);
+                    if (bits <= different_bits) {
+                        matches.push_back(a[i + r], b[k], bits);
+                    }
+                }
+            }
+        }
+        compare_each(a, i, a_count, b, b_count, different_bits, matches);
+    }
+#endif
+
+    Kernel choose_kernel()
+    {
+#ifdef SIMHASH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+            return Kernel{compare_avx512, 0.035};
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+            return Kernel{compare_avx2, 0.1};
+        }
+        if (__builtin_cpu_supports("popcnt")) {
+            return Kernel{compare_popcnt, 0.13};
+        }
+#endif
+        return Kernel{compare_generic, 0.6};
+    }
+
+    const Kernel& kernel()
+    {
+        static const Kernel chosen = choose_kernel();
+        return chosen;
+    }
+}
+
+void Simhash::compare_tiles(const Simhash::hash_t* a,
+                            size_t a_count,
+                            const Simhash::hash_t* b,
+                            size_t b_count,
+                            size_t different_bits,
+                            Simhash::Matches& matches)
+{
+    kernel().compare(a, a_count, b, b_count, different_bits, matches);
+}
+
+bool Simhash::brute_beats_sort(size_t count,
+                               const std::vector<Simhash::Permutation>& permutations)
+{
+    double n = static_cast<double>(count);
+    double pairs = n * (n - 1) / 2;
+
+    double sort = 0;
+    for (auto it = permutations.begin(); it != permutations.end(); ++it) {
+        double shared = pairs / std::ldexp(1.0, __builtin_popcountll(it->search_mask()));
+        sort += n * std::log2(n + 1) * SORT_COST + shared * COMPARE_COST;
+    }
+    return pairs * kernel().cost < sort;
+}
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SIMHASH_X86 1
+#endif
+
+#include "compute.h"
+#include "stoplist.h"
+
+namespace {
+    using Simhash::hash_t;
+
+    /**
+     * The number of words of weight eight and up, enough to count 2^PLANES - 1
+     * groups of eight hashes before they have to be unpacked.
+     */
+    const size_t PLANES = 16;
+
+    /**
+     * About how long compute takes per hash, for deciding whether a batch
+     * is worth splitting among threads. Measured over a million hashes.
+     */
+    const size_t NANOSECONDS_PER_HASH = 3;
+
+    /**
+     * The same with a stoplist, which with a hundred thousand hashes in it
+     * no longer fits in cache.
+     */
+    const size_t NANOSECONDS_PER_FILTERED_HASH = 20;
+
+    /**
+     * The same for compute_weighted.
+     */
+    const size_t NANOSECONDS_PER_WEIGHTED_HASH = 16;
+
+    /**
+     * The number of hashes compute filters through a stoplist at a time.
+     */
+    const size_t FILTER_BATCH = 1024;
+
+    /**
+     * A carry-save adder: the sum of the bits of a, b and c in each position,
+     * as a low bit and a high bit.
+     */
+    inline void add(hash_t& high, hash_t& low, hash_t a, hash_t b, hash_t c)
+    {
+        hash_t partial = a ^ b;
+        high = (a & b) | (partial & c);
+        low = partial ^ c;
+    }
+
+    /**
+     * Throw unless there are documents + 1 offsets into count hashes, none
+     * smaller than the one before.
+     */
+    void check_offsets(const uint64_t* offsets, size_t documents, size_t count)
+    {
+        for (size_t i = 0; i < documents; ++i) {
+            if (offsets[i] > offsets[i + 1]) {
+                throw std::invalid_argument("Offsets must not decrease");
+            }
+        }
+        if (documents && offsets[documents] > count) {
+            throw std::invalid_argument("Offsets must not pass the end of the hashes");
+        }
+    }
+
+    /**
+     * Call each(i) for every document, split among the threads of the pool
+     * if the hashes between offsets take long enough at nanoseconds each.
+     */
+    template <typename Each>
+    void for_documents(const uint64_t* offsets,
+                       size_t documents,
+                       size_t nanoseconds,
+                       Simhash::Pool& pool,
+                       Each each)
+    {
+        pool.split(documents, (offsets[documents] - offsets[0]) * nanoseconds,
+                   [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                each(i);
+            }
+        });
+    }
+
+    typedef void (*WeighKernel)(const hash_t*, const double*, size_t, double*);
+
+    /**
+     * Add each hash's weight to sums[bit] for every bit it has set, and
+     * subtract it for every bit it doesn't, one bit at a time.
+     */
+    void weigh_generic(const hash_t* hashes, const double* weights, size_t count, double* sums)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            hash_t hash = hashes[i];
+            const double signed_weights[2] = {-weights[i], weights[i]};
+            for (size_t bit = 0; bit < Simhash::BITS; ++bit) {
+                sums[bit] += signed_weights[(hash >> bit) & 1];
+            }
+        }
+    }
+
+#ifdef SIMHASH_X86
+    /**
+     * Like weigh_generic, four bits at a time: each bit's lane gets the
+     * weight with its sign flipped unless the bit is set. The sums are
+     * added in the same order, so the results are exactly the same.
+     */
+    __attribute__((target("avx2")))
+    void weigh_avx2(const hash_t* hashes, const double* weights, size_t count, double* sums)
+    {
+        const __m256i lanes = _mm256_setr_epi64x(1, 2, 4, 8);
+        const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(0x8000000000000000ULL));
+        __m256d totals[Simhash::BITS / 4];
+        for (size_t g = 0; g < Simhash::BITS / 4; ++g) {
+            totals[g] = _mm256_loadu_pd(sums + 4 * g);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            __m256i hash = _mm256_set1_epi64x(static_cast<long long>(hashes[i]));
+            __m256d weight = _mm256_set1_pd(weights[i]);
+            for (size_t g = 0; g < Simhash::BITS / 4; ++g) {
+                __m256i set = _mm256_cmpeq_epi64(_mm256_and_si256(hash, lanes), lanes);
+                __m256d flip = _mm256_castsi256_pd(_mm256_andnot_si256(set, sign));
+                totals[g] = _mm256_add_pd(totals[g], _mm256_xor_pd(weight, flip));
+                hash = _mm256_srli_epi64(hash, 4);
+            }
+        }
+        for (size_t g = 0; g < Simhash::BITS / 4; ++g) {
+            _mm256_storeu_pd(sums + 4 * g, totals[g]);
+        }
+    }
+#endif
+
+    WeighKernel choose_weigh()
+    {
+#ifdef SIMHASH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return weigh_avx2;
+        }
+#endif
+        return weigh_generic;
+    }
+
+    /**
+     * The simhash of count hashes, given how many have each bit set.
+     */
+    hash_t majority(const uint64_t* counts, size_t count)
+    {
+        hash_t result = 0;
+        for (size_t bit = 0; bit < Simhash::BITS; ++bit) {
+            if (2 * counts[bit] > count) {
+                result |= hash_t(1) << bit;
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Add weight << i to counts[bit] for every bit set in planes[i].
+     */
+    void unpack(const hash_t* planes, size_t size, uint64_t weight, uint64_t* counts)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            for (hash_t plane = planes[i]; plane; plane &= plane - 1) {
+                counts[__builtin_ctzll(plane)] += weight << i;
+            }
+        }
+    }
+
+    /**
+     * Add to counts[bit] the number of the hashes that have that bit set,
+     * eight hashes at a time, as compute describes.
+     */
+    void count_bits(const hash_t* hashes, size_t count, uint64_t* counts)
+    {
+        hash_t ones = 0;
+        hash_t twos = 0;
+        hash_t fours = 0;
+        hash_t eights[PLANES] = {0};
+        size_t groups = 0;
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const hash_t* group = hashes + i;
+            hash_t twos_a, twos_b, fours_a, fours_b, carry;
+            add(twos_a, ones, ones, group[0], group[1]);
+            add(twos_b, ones, ones, group[2], group[3]);
+            add(fours_a, twos, twos, twos_a, twos_b);
+            add(twos_a, ones, ones, group[4], group[5]);
+            add(twos_b, ones, ones, group[6], group[7]);
+            add(fours_b, twos, twos, twos_a, twos_b);
+            add(carry, fours, fours, fours_a, fours_b);
+
+            // On average this carries into two words.
+            for (size_t plane = 0; carry; ++plane) {
+                hash_t next = eights[plane] & carry;
+                eights[plane] ^= carry;
+                carry = next;
+            }
+            if (++groups == (size_t(1) << PLANES) - 1) {
+                unpack(eights, PLANES, 8, counts);
+                std::fill(eights, eights + PLANES, 0);
+                groups = 0;
+            }
+        }
+        unpack(eights, PLANES, 8, counts);
+        unpack(&ones, 1, 1, counts);
+        unpack(&twos, 1, 2, counts);
+        unpack(&fours, 1, 4, counts);
+        for (; i < count; ++i) {
+            unpack(hashes + i, 1, 1, counts);
+        }
+    }
+}
+
+Simhash::hash_t Simhash::compute(const Simhash::hash_t* hashes, size_t count)
+{
+    uint64_t counts[BITS] = {0};
+    count_bits(hashes, count, counts);
+    return majority(counts, count);
+}
+
+Simhash::hash_t Simhash::compute(const Simhash::hash_t* hashes,
+                                 size_t count,
+                                 const Simhash::Stoplist& stoplist)
+{
+    uint64_t counts[BITS] = {0};
+    hash_t kept[FILTER_BATCH];
+    size_t total = 0;
+    for (size_t i = 0; i < count; i += FILTER_BATCH) {
+        size_t size = stoplist.filter(hashes + i, std::min(FILTER_BATCH, count - i), kept);
+        count_bits(kept, size, counts);
+        total += size;
+    }
+    return majority(counts, total);
+}
+
+void Simhash::compute_many(const Simhash::hash_t* hashes,
+                           size_t count,
+                           const uint64_t* offsets,
+                           size_t documents,
+                           Simhash::hash_t* results,
+                           Simhash::Pool& pool)
+{
+    check_offsets(offsets, documents, count);
+    for_documents(offsets, documents, NANOSECONDS_PER_HASH, pool, [&](size_t i) {
+        results[i] = compute(hashes + offsets[i], offsets[i + 1] - offsets[i]);
+    });
+}
+
+void Simhash::compute_many(const Simhash::hash_t* hashes,
+                           size_t count,
+                           const uint64_t* offsets,
+                           size_t documents,
+                           const Simhash::Stoplist& stoplist,
+                           Simhash::hash_t* results,
+                           Simhash::Pool& pool)
+{
+    check_offsets(offsets, documents, count);
+    for_documents(offsets, documents, NANOSECONDS_PER_FILTERED_HASH, pool, [&](size_t i) {
+        results[i] = compute(hashes + offsets[i], offsets[i + 1] - offsets[i], stoplist);
+    });
+}
+
+Simhash::hash_t Simhash::compute_weighted(const Simhash::hash_t* hashes,
+                                          const double* weights,
+                                          size_t count)
+{
+    static const WeighKernel weigh = choose_weigh();
+    double sums[BITS] = {0};
+    weigh(hashes, weights, count, sums);
+
+    hash_t result = 0;
+    for (size_t bit = 0; bit < BITS; ++bit) {
+        if (sums[bit] > 0) {
+            result |= hash_t(1) << bit;
+        }
+    }
+    return result;
+}
+
+void Simhash::compute_weighted_many(const Simhash::hash_t* hashes,
+                                    const double* weights,
+                                    size_t count,
+                                    const uint64_t* offsets,
+                                    size_t documents,
+                                    Simhash::hash_t* results,
+                                    Simhash::Pool& pool)
+{
+    check_offsets(offsets, documents, count);
+    for_documents(offsets, documents, NANOSECONDS_PER_WEIGHTED_HASH, pool, [&](size_t i) {
+        results[i] = compute_weighted(hashes + offsets[i], weights + offsets[i],
+                                      offsets[i + 1] - offsets[i]);
+    });
+}
+
+Simhash::Accumulator::Accumulator()
+    : sums_()
+{
+}
+
+void Simhash::Accumulator::add(Simhash::hash_t hash, int64_t weight)
+{
+    for (size_t bit = 0; bit < BITS; ++bit) {
+        sums_[bit] += (2 * static_cast<int64_t>((hash >> bit) & 1) - 1) * weight;
+    }
+}
+
+void Simhash::Accumulator::add(const Simhash::hash_t* hashes, size_t count)
+{
+    uint64_t counts[BITS] = {0};
+    count_bits(hashes, count, counts);
+    for (size_t bit = 0; bit < BITS; ++bit) {
+        sums_[bit] += 2 * static_cast<int64_t>(counts[bit]) - static_cast<int64_t>(count);
+    }
+}
+
+void Simhash::Accumulator::remove(Simhash::hash_t hash, int64_t weight)
+{
+    add(hash, -weight);
+}
+
+void Simhash::Accumulator::remove(const Simhash::hash_t* hashes, size_t count)
+{
+    uint64_t counts[BITS] = {0};
+    count_bits(hashes, count, counts);
+    for (size_t bit = 0; bit < BITS; ++bit) {
+        sums_[bit] -= 2 * static_cast<int64_t>(counts[bit]) - static_cast<int64_t>(count);
+    }
+}
+
+void Simhash::Accumulator::merge(const Simhash::Accumulator& other)
+{
+    for (size_t bit = 0; bit < BITS; ++bit) {
+        sums_[bit] += other.sums_[bit];
+    }
+}
+
+Simhash::hash_t Simhash::Accumulator::digest() const
+{
+    hash_t result = 0;
+    for (size_t bit = 0; bit < BITS; ++bit) {
+        if (sums_[bit] > 0) {
+            result |= hash_t(1) << bit;
+        }
+    }
+    return result;
+}
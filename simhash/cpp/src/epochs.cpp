@@ -0,0 +1,76 @@
+#include <functional>
+#include <limits>
+#include <thread>
+
+#include "epochs.h"
+
+Simhash::Epochs::Epochs()
+    : epoch_(1)
+    , retired_()
+{
+    for (size_t i = 0; i < SLOTS; ++i) {
+        slots_[i].epoch.store(0);
+    }
+}
+
+Simhash::Epochs::~Epochs()
+{
+    retired_.clear();
+}
+
+Simhash::Epochs::Guard::Guard(Simhash::Epochs& epochs)
+    : slot_(epochs.enter())
+{
+}
+
+Simhash::Epochs::Guard::~Guard()
+{
+    slot_.store(0);
+}
+
+std::atomic<uint64_t>& Simhash::Epochs::enter()
+{
+    // Start probing at a slot that depends on the thread, so that readers on
+    // different threads usually find a free slot on the first try.
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    while (true) {
+        for (size_t i = 0; i < SLOTS; ++i) {
+            Slot& slot = slots_[(start + i) % SLOTS];
+            uint64_t expected = 0;
+            if (slot.epoch.load(std::memory_order_relaxed) == 0 &&
+                slot.epoch.compare_exchange_strong(expected, epoch_.load())) {
+                return slot.epoch;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+void Simhash::Epochs::retire(std::shared_ptr<const void> object)
+{
+    // Any reader that loaded the object did so after entering with an epoch
+    // no later than this one, so it's safe to delete once every active
+    // reader has a later epoch.
+    uint64_t epoch = epoch_.fetch_add(1);
+    retired_.push_back(std::make_pair(epoch, std::move(object)));
+    reclaim();
+}
+
+void Simhash::Epochs::reclaim()
+{
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (size_t i = 0; i < SLOTS; ++i) {
+        uint64_t epoch = slots_[i].epoch.load();
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); ++i) {
+        if (retired_[i].first >= oldest) {
+            retired_[kept++] = std::move(retired_[i]);
+        }
+    }
+    retired_.resize(kept);
+}
@@ -0,0 +1,876 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+
+#include "blocks.h"
+#include "find.h"
+#include "schedule.h"
+
+namespace {
+    using Simhash::hash_t;
+
+    /**
+     * The first word of every table file, "SIMHASHT" in ASCII.
+     */
+    const uint64_t MAGIC = 0x54485341484d4953ULL;
+
+    /**
+     * The number of words in a table file's header: the magic number, the
+     * table, the number of tables, different_bits, the table's search mask,
+     * its permutation's layout and the number of rows.
+     */
+    const size_t HEADER = 5 + Simhash::LAYOUT_WORDS + 1;
+
+    /**
+     * The header of a table file, or what it should be, other than its magic
+     * number and number of rows.
+     */
+    void describe(const Simhash::Permutation& permutation,
+                  size_t table,
+                  size_t tables,
+                  size_t different_bits,
+                  uint64_t* header)
+    {
+        header[1] = table;
+        header[2] = tables;
+        header[3] = different_bits;
+        header[4] = permutation.search_mask();
+        Simhash::layout_of(permutation, header + 5);
+    }
+
+    std::vector<hash_t> unique_sorted(const hash_t* hashes, size_t count)
+    {
+        std::vector<hash_t> result(hashes, hashes + count);
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    std::vector<hash_t> unique_sorted(const std::vector<hash_t>& hashes)
+    {
+        return unique_sorted(hashes.data(), hashes.size());
+    }
+
+    /**
+     * The bits of each table's prefix, in the original order. A pair shares
+     * a prefix in a table exactly when none of the bits it differs in are in
+     * that table's prefix.
+     */
+    std::vector<hash_t> prefixes_of(const std::vector<Simhash::Permutation>& permutations)
+    {
+        std::vector<hash_t> result;
+        for (auto it = permutations.begin(); it != permutations.end(); ++it) {
+            result.push_back(it->reverse(it->search_mask()));
+        }
+        return result;
+    }
+
+    /**
+     * Whether table t is the first in which a pair differing in these bits
+     * shares a prefix, and so the one that should report it.
+     */
+    inline bool first_table(const std::vector<hash_t>& prefixes, size_t t, hash_t differing)
+    {
+        for (size_t earlier = 0; earlier < t; ++earlier) {
+            if ((prefixes[earlier] & differing) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * The hashes, permuted and sorted.
+     */
+    std::vector<hash_t> permuted(const Simhash::Permutation& permutation,
+                                 const std::vector<hash_t>& hashes)
+    {
+        std::vector<hash_t> keys(hashes.size());
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            keys[i] = permutation.apply(hashes[i]);
+        }
+        std::sort(keys.begin(), keys.end());
+        return keys;
+    }
+
+    /**
+     * Walk the runs of sorted, permuted queries and corpus hashes that share
+     * a prefix in table t, and report each matching cross pair.
+     */
+    void scan_between(const Simhash::Permutation& permutation,
+                      size_t t,
+                      const std::vector<hash_t>& prefixes,
+                      const std::vector<hash_t>& queries,
+                      const std::vector<hash_t>& corpus,
+                      size_t different_bits,
+                      Simhash::Matches& matches)
+    {
+        hash_t mask = permutation.search_mask();
+        auto candidates = corpus.begin();
+        for (auto start = queries.begin(); start != queries.end(); ) {
+            hash_t prefix = *start & mask;
+            auto end = start + 1;
+            while (end != queries.end() && (*end & mask) == prefix) {
+                ++end;
+            }
+
+            candidates = std::lower_bound(candidates, corpus.end(), prefix);
+            auto last = candidates;
+            while (last != corpus.end() && (*last & mask) == prefix) {
+                ++last;
+            }
+
+            for (auto q = start; q != end; ++q) {
+                for (auto c = candidates; c != last; ++c) {
+                    size_t bits = static_cast<size_t>(__builtin_popcountll(*q ^ *c));
+                    if (bits <= different_bits &&
+                        first_table(prefixes, t, permutation.reverse(*q ^ *c))) {
+                        matches.push_back(
+                            permutation.reverse(*q), permutation.reverse(*c), bits);
+                    }
+                }
+            }
+            candidates = last;
+            start = end;
+        }
+    }
+
+    /**
+     * Walk the runs of sorted, permuted hashes that share a prefix in table
+     * t, and report each matching pair, smaller hash first.
+     */
+    void scan_within(const Simhash::Permutation& permutation,
+                     size_t t,
+                     const std::vector<hash_t>& prefixes,
+                     const std::vector<hash_t>& keys,
+                     size_t different_bits,
+                     Simhash::Matches& matches)
+    {
+        hash_t mask = permutation.search_mask();
+        for (auto start = keys.begin(); start != keys.end(); ) {
+            hash_t prefix = *start & mask;
+            auto end = start + 1;
+            while (end != keys.end() && (*end & mask) == prefix) {
+                ++end;
+            }
+
+            for (auto a = start; a != end; ++a) {
+                for (auto b = a + 1; b != end; ++b) {
+                    size_t bits = static_cast<size_t>(__builtin_popcountll(*a ^ *b));
+                    if (bits <= different_bits &&
+                        first_table(prefixes, t, permutation.reverse(*a ^ *b))) {
+                        hash_t x = permutation.reverse(*a);
+                        hash_t y = permutation.reverse(*b);
+                        matches.push_back(std::min(x, y), std::max(x, y), bits);
+                    }
+                }
+            }
+            start = end;
+        }
+    }
+
+    /**
+     * The fewest hashes read, buffered or sorted at once by
+     * find_matches_external, however small its memory budget.
+     */
+    const size_t MINIMUM_BUFFER = 4096;
+
+    /**
+     * The most runs find_matches_external merges at once, which bounds the
+     * files it holds open.
+     */
+    const size_t MAXIMUM_FAN_IN = 64;
+
+    /**
+     * The most runs that can be merged at once in memory bytes, where each of
+     * them and the output needs a buffer of at least MINIMUM_BUFFER hashes.
+     */
+    size_t fan_in(size_t memory)
+    {
+        size_t buffers = memory / sizeof(Simhash::hash_t) / MINIMUM_BUFFER;
+        return std::min(MAXIMUM_FAN_IN, std::max(buffers, size_t(3)) - 1);
+    }
+
+    /**
+     * The fewest hashes probed for as one task by find_matches_ball.
+     */
+    const size_t MINIMUM_TASK = 4096;
+
+    /**
+     * An open file that's closed when it goes out of scope, and that throws
+     * whenever something goes wrong.
+     */
+    class File {
+    public:
+        File(const std::string& name, const char* mode)
+            : name_(name)
+            , file_(std::fopen(name.c_str(), mode))
+        {
+            if (!file_) {
+                throw std::runtime_error("Could not open " + name);
+            }
+        }
+
+        ~File()
+        {
+            if (file_) {
+                std::fclose(file_);
+            }
+        }
+
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        /**
+         * The size of the file in bytes.
+         */
+        size_t size()
+        {
+            if (std::fseek(file_, 0, SEEK_END) != 0) {
+                throw std::runtime_error("Could not read " + name_);
+            }
+            long size = std::ftell(file_);
+            if (size < 0 || std::fseek(file_, 0, SEEK_SET) != 0) {
+                throw std::runtime_error("Could not read " + name_);
+            }
+            return static_cast<size_t>(size);
+        }
+
+        void seek(size_t offset)
+        {
+            if (std::fseek(file_, static_cast<long>(offset), SEEK_SET) != 0) {
+                throw std::runtime_error("Could not read " + name_);
+            }
+        }
+
+        /**
+         * Read up to count items, returning how many there were.
+         */
+        size_t read(void* data, size_t size, size_t count)
+        {
+            size_t read = std::fread(data, size, count, file_);
+            if (read < count && std::ferror(file_)) {
+                throw std::runtime_error("Could not read " + name_);
+            }
+            return read;
+        }
+
+        void write(const void* data, size_t size, size_t count)
+        {
+            if (std::fwrite(data, size, count, file_) != count) {
+                throw std::runtime_error("Could not write " + name_);
+            }
+        }
+
+        void close()
+        {
+            int result = std::fclose(file_);
+            file_ = nullptr;
+            if (result != 0) {
+                throw std::runtime_error("Could not write " + name_);
+            }
+        }
+
+    private:
+        std::string name_;
+        std::FILE* file_;
+    };
+
+    /**
+     * A sorted run on disk, read back one buffer at a time.
+     */
+    class Run {
+    public:
+        Run(const std::string& name, size_t buffer)
+            : file_(name, "rb")
+            , buffer_(buffer)
+            , position_(0)
+        {
+            refill();
+        }
+
+        bool empty() const { return position_ == buffer_.size(); }
+
+        hash_t front() const { return buffer_[position_]; }
+
+        void pop()
+        {
+            if (++position_ == buffer_.size()) {
+                refill();
+            }
+        }
+
+    private:
+        void refill()
+        {
+            buffer_.resize(buffer_.capacity());
+            buffer_.resize(file_.read(buffer_.data(), sizeof(hash_t), buffer_.size()));
+            position_ = 0;
+        }
+
+        File file_;
+        std::vector<hash_t> buffer_;
+        size_t position_;
+    };
+
+    /**
+     * The distinct hashes of several sorted runs on disk, in order.
+     */
+    class Merge {
+    public:
+        /**
+         * Merge the runs with these names, which hold these numbers of
+         * hashes, reading each through a buffer of up to buffer hashes.
+         */
+        Merge(const std::vector<std::string>& names,
+              const std::vector<size_t>& sizes,
+              size_t buffer)
+            : readers_()
+            , heads_()
+            , started_(false)
+            , last_(0)
+        {
+            for (size_t i = 0; i < names.size(); ++i) {
+                readers_.push_back(std::unique_ptr<Run>(
+                    new Run(names[i], std::min(buffer, sizes[i] + 1))));
+                if (!readers_[i]->empty()) {
+                    heads_.push(head_t(readers_[i]->front(), i));
+                }
+            }
+        }
+
+        /**
+         * Take the next hash into key, returning false once there are none.
+         */
+        bool next(hash_t& key)
+        {
+            while (!heads_.empty()) {
+                key = heads_.top().first;
+                size_t i = heads_.top().second;
+                heads_.pop();
+                readers_[i]->pop();
+                if (!readers_[i]->empty()) {
+                    heads_.push(head_t(readers_[i]->front(), i));
+                }
+                if (!started_ || key != last_) {
+                    started_ = true;
+                    last_ = key;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        typedef std::pair<hash_t, size_t> head_t;
+
+        std::vector<std::unique_ptr<Run> > readers_;
+        std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t> > heads_;
+        bool started_;
+        hash_t last_;
+    };
+
+    /**
+     * Merge sorted runs into one named output, reading and writing through
+     * buffers of buffer hashes, and then remove them. Returns the number of
+     * hashes written.
+     */
+    size_t merge_runs(const std::vector<std::string>& names,
+                      const std::vector<size_t>& sizes,
+                      const std::string& output,
+                      size_t buffer)
+    {
+        size_t written = 0;
+        {
+            Merge merge(names, sizes, buffer);
+            File out(output, "wb");
+            std::vector<hash_t> pending;
+            pending.reserve(buffer);
+            hash_t key;
+            while (merge.next(key)) {
+                pending.push_back(key);
+                if (pending.size() == buffer) {
+                    out.write(pending.data(), sizeof(hash_t), pending.size());
+                    written += pending.size();
+                    pending.clear();
+                }
+            }
+            out.write(pending.data(), sizeof(hash_t), pending.size());
+            written += pending.size();
+            out.close();
+        }
+        for (auto it = names.begin(); it != names.end(); ++it) {
+            std::remove(it->c_str());
+        }
+        return written;
+    }
+
+    /**
+     * Removes the files it names when it goes out of scope.
+     */
+    struct Cleanup {
+        std::vector<std::string> names;
+
+        ~Cleanup()
+        {
+            for (auto it = names.begin(); it != names.end(); ++it) {
+                std::remove(it->c_str());
+            }
+        }
+    };
+
+    /**
+     * Append matches to a file as packed records.
+     */
+    void write_matches(File& file, const Simhash::Matches& matches)
+    {
+        std::vector<unsigned char> records(matches.size() * Simhash::MATCH_RECORD_SIZE);
+        unsigned char* record = records.data();
+        for (size_t i = 0; i < matches.size(); ++i) {
+            std::memcpy(record, &matches.first[i], sizeof(hash_t));
+            std::memcpy(record + sizeof(hash_t), &matches.second[i], sizeof(hash_t));
+            record[2 * sizeof(hash_t)] = matches.distance[i];
+            record += Simhash::MATCH_RECORD_SIZE;
+        }
+        file.write(records.data(), 1, records.size());
+    }
+
+    Simhash::Matches concatenate(std::vector<Simhash::Matches>& found)
+    {
+        Simhash::Matches results;
+        for (auto it = found.begin(); it != found.end(); ++it) {
+            results.append(*it);
+        }
+        return results;
+    }
+}
+
+void Simhash::Matches::append(Simhash::Matches& other)
+{
+    first.insert(first.end(), other.first.begin(), other.first.end());
+    second.insert(second.end(), other.second.begin(), other.second.end());
+    distance.insert(distance.end(), other.distance.begin(), other.distance.end());
+    other = Matches();
+}
+
+Simhash::Matches Simhash::find_matches(const std::vector<Simhash::hash_t>& hashes,
+                                       size_t number_of_blocks,
+                                       size_t different_bits,
+                                       Simhash::Pool& pool)
+{
+    return find_matches(hashes.data(), hashes.size(), number_of_blocks, different_bits, pool);
+}
+
+Simhash::Matches Simhash::find_matches(const Simhash::hash_t* hashes,
+                                       size_t count,
+                                       size_t number_of_blocks,
+                                       size_t different_bits,
+                                       Simhash::Pool& pool)
+{
+    return find_matches(hashes, count, Permutation::choose(number_of_blocks, different_bits),
+                        different_bits, pool);
+}
+
+Simhash::Matches Simhash::find_matches(const std::vector<Simhash::hash_t>& hashes,
+                                       const std::vector<Simhash::Permutation>& permutations,
+                                       size_t different_bits,
+                                       Simhash::Pool& pool)
+{
+    return find_matches(hashes.data(), hashes.size(), permutations, different_bits, pool);
+}
+
+Simhash::Matches Simhash::find_matches(const Simhash::hash_t* hashes,
+                                       size_t count,
+                                       const std::vector<Simhash::Permutation>& permutations,
+                                       size_t different_bits,
+                                       Simhash::Pool& pool)
+{
+    // The other engines find every match, so they only stand in for tables
+    // that would too.
+    if (complete(permutations, different_bits)) {
+        if (ball_beats_sort(count, different_bits, permutations.size())) {
+            return find_matches_ball(hashes, count, different_bits, pool);
+        }
+        if (brute_beats_sort(count, permutations)) {
+            return find_matches_brute(hashes, count, different_bits, pool);
+        }
+    }
+
+    std::vector<hash_t> prefixes = prefixes_of(permutations);
+    std::vector<hash_t> unique = unique_sorted(hashes, count);
+
+    std::vector<Matches> found(permutations.size());
+    pool.run(permutations.size(), [&](size_t t) {
+        scan_within(permutations[t], t, prefixes,
+                    permuted(permutations[t], unique), different_bits, found[t]);
+    });
+    return concatenate(found);
+}
+
+Simhash::Matches Simhash::find_matches_ball(const Simhash::hash_t* hashes,
+                                            size_t count,
+                                            size_t different_bits,
+                                            Simhash::Pool& pool)
+{
+    std::vector<hash_t> unique = unique_sorted(hashes, count);
+    HashTable table(unique.data(), unique.size());
+
+    // Each pair turns up from both ends, and is kept from the smaller.
+    size_t tasks = std::min(unique.size() / MINIMUM_TASK + 1, pool.threads() * 8);
+    std::vector<Matches> found(tasks);
+    pool.run(tasks, [&](size_t task) {
+        Matches& matches = found[task];
+        size_t end = unique.size() * (task + 1) / tasks;
+        for (size_t i = unique.size() * task / tasks; i < end; ++i) {
+            hash_t hash = unique[i];
+            visit_ball(hash, different_bits, [&](hash_t other, size_t bits) {
+                if (other > hash && table.contains(other)) {
+                    matches.push_back(hash, other, bits);
+                }
+            });
+        }
+    });
+    return concatenate(found);
+}
+
+Simhash::Matches Simhash::find_matches_brute(const Simhash::hash_t* hashes,
+                                             size_t count,
+                                             size_t different_bits,
+                                             Simhash::Pool& pool)
+{
+    std::vector<hash_t> unique = unique_sorted(hashes, count);
+
+    // Since the hashes are sorted, each pair is found with the smaller first.
+    size_t tiles = (unique.size() + TILE - 1) / TILE;
+    std::vector<Matches> found(tiles);
+    pool.run(tiles, [&](size_t i) {
+        const hash_t* a = unique.data() + i * TILE;
+        size_t a_count = std::min(TILE, unique.size() - i * TILE);
+        for (size_t j = i; j < tiles; ++j) {
+            const hash_t* b = unique.data() + j * TILE;
+            size_t b_count = std::min(TILE, unique.size() - j * TILE);
+            compare_tiles(a, a_count, b, b_count, different_bits, found[i]);
+        }
+    });
+    return concatenate(found);
+}
+
+void Simhash::append_matches(const std::string& output, const Simhash::Matches& matches)
+{
+    File out(output, "ab");
+    write_matches(out, matches);
+    out.close();
+}
+
+size_t Simhash::find_matches_external(const std::string& input,
+                                      const std::string& output,
+                                      size_t number_of_blocks,
+                                      size_t different_bits,
+                                      size_t memory,
+                                      const std::string& directory,
+                                      Simhash::Pool& pool)
+{
+    return find_matches_external(input, output,
+                                 Permutation::choose(number_of_blocks, different_bits),
+                                 different_bits, memory, directory, pool);
+}
+
+size_t Simhash::find_matches_external(const std::string& input,
+                                      const std::string& output,
+                                      const std::vector<Simhash::Permutation>& permutations,
+                                      size_t different_bits,
+                                      size_t memory,
+                                      const std::string& directory,
+                                      Simhash::Pool& pool)
+{
+    std::vector<hash_t> prefixes = prefixes_of(permutations);
+
+    size_t bytes = File(input, "rb").size();
+    if (bytes % sizeof(hash_t)) {
+        throw std::runtime_error(input + " doesn't hold a whole number of hashes");
+    }
+    size_t count = bytes / sizeof(hash_t);
+
+    // Every thread may be sorting a chunk, or merging runs, at once.
+    size_t chunk = std::max(memory / sizeof(hash_t) / pool.threads(), MINIMUM_BUFFER);
+    size_t chunks = (count + chunk - 1) / chunk;
+    size_t width = fan_in(memory / pool.threads());
+    Cleanup runs;
+    auto run_name = [&](size_t i) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/run-%zu", i);
+        runs.names.push_back(directory + name);
+        return runs.names.back();
+    };
+    std::vector<std::string> chunk_names;
+    for (size_t i = 0; i < chunks; ++i) {
+        chunk_names.push_back(run_name(i));
+    }
+
+    File out(output, "ab");
+    size_t total = 0;
+    std::vector<size_t> sizes(chunks);
+    for (size_t t = 0; t < permutations.size(); ++t) {
+        const Permutation& permutation = permutations[t];
+        hash_t mask = permutation.search_mask();
+        pool.run(chunks, [&](size_t i) {
+            size_t begin = i * chunk;
+            std::vector<hash_t> keys(std::min(chunk, count - begin));
+            File source(input, "rb");
+            source.seek(begin * sizeof(hash_t));
+            if (source.read(keys.data(), sizeof(hash_t), keys.size()) != keys.size()) {
+                throw std::runtime_error("Could not read " + input);
+            }
+            for (auto it = keys.begin(); it != keys.end(); ++it) {
+                *it = permutation.apply(*it);
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            sizes[i] = keys.size();
+
+            File run(chunk_names[i], "wb");
+            run.write(keys.data(), sizeof(hash_t), keys.size());
+            run.close();
+        });
+
+        // Merge the runs a group at a time until few enough are left for one
+        // final merge, so that neither the open files nor the buffers grow
+        // with the input.
+        std::vector<std::string> names = chunk_names;
+        std::vector<size_t> counts = sizes;
+        size_t created = chunks;
+        while (names.size() > width) {
+            size_t groups = (names.size() + width - 1) / width;
+            std::vector<std::string> merged;
+            for (size_t g = 0; g < groups; ++g) {
+                merged.push_back(run_name(created++));
+            }
+            std::vector<size_t> merged_counts(groups);
+            size_t budget = memory / std::min(pool.threads(), groups);
+            size_t group_buffer = std::max(budget / sizeof(hash_t) / (width + 1), MINIMUM_BUFFER);
+            pool.run(groups, [&](size_t g) {
+                size_t begin = g * width;
+                size_t end = std::min(begin + width, names.size());
+                merged_counts[g] = merge_runs(
+                    std::vector<std::string>(names.begin() + begin, names.begin() + end),
+                    std::vector<size_t>(counts.begin() + begin, counts.begin() + end),
+                    merged[g], group_buffer);
+            });
+            names.swap(merged);
+            counts.swap(merged_counts);
+        }
+
+        // Merge the rest, collecting each group of hashes that share a prefix
+        // and scanning it once the next prefix comes along.
+        size_t buffer = std::max(memory / sizeof(hash_t) / (names.size() + 1), MINIMUM_BUFFER);
+        Merge merge(names, counts, buffer);
+
+        std::vector<hash_t> group;
+        Matches matches;
+        auto scan = [&]() {
+            scan_within(permutation, t, prefixes, group, different_bits, matches);
+            group.clear();
+            if (matches.size() >= buffer) {
+                write_matches(out, matches);
+                total += matches.size();
+                matches = Matches();
+            }
+        };
+        hash_t key;
+        while (merge.next(key)) {
+            if (!group.empty() && (key & mask) != (group.front() & mask)) {
+                scan();
+            }
+            group.push_back(key);
+        }
+        scan();
+        write_matches(out, matches);
+        total += matches.size();
+    }
+    out.close();
+    return total;
+}
+
+Simhash::Tables::Tables(const std::vector<Simhash::hash_t>& hashes,
+                        size_t number_of_blocks,
+                        size_t different_bits,
+                        Simhash::Pool& pool)
+    : Tables(hashes, Permutation::choose(number_of_blocks, different_bits),
+             different_bits, pool)
+{
+}
+
+Simhash::Tables::Tables(const std::vector<Simhash::hash_t>& hashes,
+                        const std::vector<Simhash::Permutation>& permutations,
+                        size_t different_bits,
+                        Simhash::Pool& pool)
+    : different_bits_(different_bits)
+    , permutations_(permutations)
+    , prefixes_(prefixes_of(permutations_))
+    , tables_(permutations_.size())
+{
+    std::vector<hash_t> unique = unique_sorted(hashes);
+    pool.run(permutations_.size(), [&](size_t t) {
+        tables_[t] = permuted(permutations_[t], unique);
+    });
+}
+
+Simhash::Matches Simhash::Tables::find(const std::vector<Simhash::hash_t>& queries,
+                                       Simhash::Pool& pool) const
+{
+    std::vector<hash_t> unique = unique_sorted(queries);
+    std::vector<Matches> found(permutations_.size());
+    pool.run(permutations_.size(), [&](size_t t) {
+        scan_between(permutations_[t], t, prefixes_,
+                     permuted(permutations_[t], unique), tables_[t],
+                     different_bits_, found[t]);
+    });
+    return concatenate(found);
+}
+
+Simhash::Matches Simhash::Tables::add(const std::vector<Simhash::hash_t>& hashes,
+                                      Simhash::Pool& pool)
+{
+    std::vector<hash_t> fresh;
+    if (!tables_.empty()) {
+        const Permutation& permutation = permutations_[0];
+        const std::vector<hash_t>& table = tables_[0];
+        std::vector<hash_t> unique = unique_sorted(hashes);
+        for (auto it = unique.begin(); it != unique.end(); ++it) {
+            if (!std::binary_search(table.begin(), table.end(), permutation.apply(*it))) {
+                fresh.push_back(*it);
+            }
+        }
+    }
+
+    std::vector<Matches> found(permutations_.size());
+    pool.run(permutations_.size(), [&](size_t t) {
+        const Permutation& permutation = permutations_[t];
+        std::vector<hash_t> keys = permuted(permutation, fresh);
+        std::vector<hash_t>& table = tables_[t];
+
+        // Pairs of a new and an old hash are found with the new one first.
+        Matches& matches = found[t];
+        scan_between(permutation, t, prefixes_, keys, table, different_bits_, matches);
+        for (size_t i = 0; i < matches.size(); ++i) {
+            if (matches.first[i] > matches.second[i]) {
+                std::swap(matches.first[i], matches.second[i]);
+            }
+        }
+        scan_within(permutation, t, prefixes_, keys, different_bits_, matches);
+
+        std::vector<hash_t> merged(table.size() + keys.size());
+        std::merge(table.begin(), table.end(), keys.begin(), keys.end(), merged.begin());
+        table.swap(merged);
+    });
+    return concatenate(found);
+}
+
+void Simhash::Tables::save(const std::string& prefix, Simhash::Pool& pool) const
+{
+    pool.run(tables_.size(), [&](size_t t) {
+        const std::vector<hash_t>& table = tables_[t];
+        uint64_t header[HEADER];
+        header[0] = MAGIC;
+        describe(permutations_[t], t, tables_.size(), different_bits_, header);
+        header[HEADER - 1] = table.size();
+
+        std::string name = filename(prefix, t);
+        std::FILE* file = std::fopen(name.c_str(), "wb");
+        if (!file) {
+            throw std::runtime_error("Could not open " + name);
+        }
+        bool written =
+            std::fwrite(header, sizeof(uint64_t), HEADER, file) == HEADER &&
+            std::fwrite(table.data(), sizeof(hash_t), table.size(), file) == table.size();
+        if (std::fclose(file) != 0 || !written) {
+            throw std::runtime_error("Could not write " + name);
+        }
+    });
+}
+
+void Simhash::Tables::load(const std::string& prefix, Simhash::Pool& pool)
+{
+    // Each file's header says which parameters it was saved with, so read
+    // the first table's before looking for the rest.
+    std::vector<std::vector<hash_t> > loaded(tables_.size());
+    auto read = [&](size_t t, bool rows) {
+        std::string name = filename(prefix, t);
+        std::FILE* file = std::fopen(name.c_str(), "rb");
+        if (!file) {
+            throw std::runtime_error("Could not open " + name);
+        }
+
+        uint64_t header[HEADER];
+        uint64_t expected[HEADER];
+        describe(permutations_[t], t, tables_.size(), different_bits_, expected);
+        bool valid = std::fread(header, sizeof(uint64_t), HEADER, file) == HEADER &&
+            header[0] == MAGIC &&
+            header[1] == t;
+        bool matching = valid &&
+            std::equal(header + 2, header + HEADER - 1, expected + 2);
+        std::vector<hash_t>& table = loaded[t];
+        table.resize(matching && rows ? header[HEADER - 1] : 0);
+        valid = valid &&
+            std::fread(table.data(), sizeof(hash_t), table.size(), file) == table.size();
+        std::fclose(file);
+        if (!valid) {
+            throw std::runtime_error("Invalid table file " + name);
+        }
+        if (!matching) {
+            throw std::invalid_argument(
+                "Tables under " + prefix + " were saved with different parameters");
+        }
+    };
+    read(0, false);
+    pool.run(tables_.size(), [&](size_t t) { read(t, true); });
+
+    for (auto it = loaded.begin(); it != loaded.end(); ++it) {
+        if (it->size() != loaded[0].size()) {
+            throw std::runtime_error("Table files under " + prefix + " disagree");
+        }
+    }
+    tables_.swap(loaded);
+}
+
+std::string Simhash::Tables::filename(const std::string& prefix, size_t table)
+{
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "-table-%zu", table);
+    return prefix + suffix;
+}
+
+Simhash::Matches Simhash::find_between(const std::vector<Simhash::hash_t>& queries,
+                                       const std::vector<Simhash::hash_t>& corpus,
+                                       size_t number_of_blocks,
+                                       size_t different_bits,
+                                       Simhash::Pool& pool)
+{
+    return find_between(queries, corpus, Permutation::choose(number_of_blocks, different_bits),
+                        different_bits, pool);
+}
+
+Simhash::Matches Simhash::find_between(const std::vector<Simhash::hash_t>& queries,
+                                       const std::vector<Simhash::hash_t>& corpus,
+                                       const std::vector<Simhash::Permutation>& permutations,
+                                       size_t different_bits,
+                                       Simhash::Pool& pool)
+{
+    std::vector<hash_t> prefixes = prefixes_of(permutations);
+    std::vector<hash_t> unique_queries = unique_sorted(queries);
+    std::vector<hash_t> unique_corpus = unique_sorted(corpus);
+
+    // Only one table per thread is kept at a time.
+    std::vector<Matches> found(permutations.size());
+    pool.run(permutations.size(), [&](size_t t) {
+        const Permutation& permutation = permutations[t];
+        scan_between(permutation, t, prefixes,
+                     permuted(permutation, unique_queries),
+                     permuted(permutation, unique_corpus),
+                     different_bits, found[t]);
+    });
+    return concatenate(found);
+}
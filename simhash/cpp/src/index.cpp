@@ -0,0 +1,522 @@
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+#include "blocks.h"
+#include "index.h"
+
+namespace {
+    /**
+     * The first word of a saved index's manifest, "SIMHASHI" in ASCII.
+     */
+    const uint64_t MAGIC = 0x49485341484d4953ULL;
+
+    /**
+     * The number of words in a manifest before the tables': the magic
+     * number, different_bits, the number of tables and the number of
+     * segments.
+     */
+    const size_t MANIFEST = 4;
+
+    /**
+     * The number of words a manifest describes each table with: its search
+     * mask and its permutation's layout.
+     */
+    const size_t TABLE_WORDS = 1 + Simhash::LAYOUT_WORDS;
+
+    /**
+     * What a manifest says about these permutations' tables.
+     */
+    std::vector<uint64_t> describe(const std::vector<Simhash::Permutation>& permutations)
+    {
+        std::vector<uint64_t> words(permutations.size() * TABLE_WORDS);
+        for (size_t t = 0; t < permutations.size(); ++t) {
+            words[t * TABLE_WORDS] = permutations[t].search_mask();
+            Simhash::layout_of(permutations[t], &words[t * TABLE_WORDS + 1]);
+        }
+        return words;
+    }
+}
+
+Simhash::Index::Index(size_t number_of_blocks,
+                      size_t different_bits,
+                      size_t memtable_capacity,
+                      size_t merge_factor,
+                      size_t threads)
+    : Index(Permutation::choose(number_of_blocks, different_bits), different_bits,
+            memtable_capacity, merge_factor, threads)
+{
+}
+
+Simhash::Index::Index(const std::vector<Simhash::Permutation>& permutations,
+                      size_t different_bits,
+                      size_t memtable_capacity,
+                      size_t merge_factor,
+                      size_t threads)
+    : different_bits_(different_bits)
+    , memtable_capacity_(memtable_capacity)
+    , merge_factor_(merge_factor)
+    , permutations_(permutations)
+    , coverage_(schedule(permutations_, different_bits))
+    , pool_(threads)
+    , epochs_()
+    , current_(nullptr)
+    , mutex_()
+    , wake_()
+    , idle_()
+    , version_()
+    , removed_()
+    , failure_()
+    , building_(false)
+    , compacting_(false)
+    , busy_(false)
+    , stopping_(false)
+    , worker_()
+{
+    if (merge_factor < 2) {
+        throw std::invalid_argument("Merge factor must be at least 2");
+    }
+
+    std::shared_ptr<Version> version(new Version());
+    version->memtable.reset(new Memtable(memtable_capacity));
+    version_ = version;
+    current_.store(version_.get());
+
+    worker_ = std::thread(&Index::run, this);
+}
+
+Simhash::Index::~Index()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    worker_.join();
+}
+
+void Simhash::Index::insert(Simhash::hash_t hash, Simhash::doc_id_t id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    rethrow();
+    version_->memtable->insert(hash, id);
+    if (version_->memtable->full()) {
+        seal();
+    }
+}
+
+size_t Simhash::Index::remove(Simhash::hash_t hash, Simhash::doc_id_t id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Version& version = *version_;
+    size_t removed = version.memtable->remove(hash, id);
+    for (auto it = version.sealed.begin(); it != version.sealed.end(); ++it) {
+        removed += (*it)->remove(hash, id);
+    }
+    for (auto it = version.segments.begin(); it != version.segments.end(); ++it) {
+        removed += (*it)->remove(hash, id);
+    }
+
+    // A segment being built may already have copied this entry, so it has
+    // to be removed from that too before it's installed.
+    if (removed && building_) {
+        removed_.push_back(entry_t(hash, id));
+    }
+    return removed;
+}
+
+std::vector<Simhash::entry_t> Simhash::Index::find(Simhash::hash_t query) const
+{
+    std::vector<entry_t> results;
+    {
+        Epochs::Guard guard(epochs_);
+        const Version& version = *current_.load();
+        version.memtable->find(query, different_bits_, results);
+        for (auto it = version.sealed.begin(); it != version.sealed.end(); ++it) {
+            (*it)->find(query, different_bits_, results);
+        }
+        for (auto it = version.segments.begin(); it != version.segments.end(); ++it) {
+            if (ball_beats_search((*it)->size(), different_bits_, permutations_.size())) {
+                (*it)->probe(query, different_bits_, results);
+            } else {
+                (*it)->find(query, different_bits_, results);
+            }
+        }
+    }
+
+    std::sort(results.begin(), results.end());
+    results.erase(std::unique(results.begin(), results.end()), results.end());
+    return results;
+}
+
+std::vector<Simhash::neighbor_t> Simhash::Index::nearest(Simhash::hash_t query,
+                                                        size_t k,
+                                                        size_t max_distance) const
+{
+    if (max_distance > different_bits_) {
+        throw std::invalid_argument("Maximum distance must be at most different_bits");
+    }
+
+    std::vector<neighbor_t> results;
+    if (k == 0) {
+        return results;
+    }
+
+    Epochs::Guard guard(epochs_);
+    const Version& version = *current_.load();
+    version.memtable->find(query, max_distance, results);
+    for (auto it = version.sealed.begin(); it != version.sealed.end(); ++it) {
+        (*it)->find(query, max_distance, results);
+    }
+
+    // Looking up every hash within max_distance turns up the nearest
+    // entries all at once. The largest segment costs the most either way,
+    // so it decides for them all.
+    size_t largest = 0;
+    for (auto it = version.segments.begin(); it != version.segments.end(); ++it) {
+        largest = std::max(largest, (*it)->size());
+    }
+    if (ball_beats_search(largest, max_distance, coverage_[max_distance])) {
+        for (auto it = version.segments.begin(); it != version.segments.end(); ++it) {
+            (*it)->probe(query, max_distance, results);
+        }
+        std::sort(results.begin(), results.end());
+        results.erase(std::unique(results.begin(), results.end()), results.end());
+        if (results.size() > k) {
+            results.resize(k);
+        }
+        return results;
+    }
+
+    // Once the first coverage_[d] tables have been searched, everything
+    // within d bits has turned up. Anything beyond the best k so far can
+    // never make it back in, so only those are kept between batches.
+    size_t begin = 0;
+    for (size_t d = 0; d <= max_distance; ++d) {
+        size_t end = coverage_[d];
+        for (auto it = version.segments.begin(); it != version.segments.end(); ++it) {
+            (*it)->find(query, max_distance, begin, end, results);
+        }
+        begin = end;
+
+        std::sort(results.begin(), results.end());
+        results.erase(std::unique(results.begin(), results.end()), results.end());
+        if (results.size() > k) {
+            results.resize(k);
+        }
+        if (results.size() == k && results.back().first <= d) {
+            break;
+        }
+    }
+    return results;
+}
+
+void Simhash::Index::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    rethrow();
+    if (version_->memtable->size()) {
+        seal();
+    }
+
+    // Wake the background thread even with nothing new to seal, in case
+    // memtables are still sealed from a build that failed.
+    busy_ = true;
+    wake_.notify_one();
+    idle_.wait(lock, [this] { return !busy_; });
+    rethrow();
+}
+
+void Simhash::Index::compact()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    rethrow();
+    if (version_->memtable->size()) {
+        seal();
+    }
+    compacting_ = true;
+    busy_ = true;
+    wake_.notify_one();
+    idle_.wait(lock, [this] { return !busy_; });
+    rethrow();
+}
+
+void Simhash::Index::save(const std::string& directory)
+{
+    flush();
+    std::shared_ptr<const Version> version;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        version = version_;
+    }
+
+    const std::vector<Segment::ptr_t>& segments = version->segments;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        segments[i]->save(segment_prefix(directory, i), pool_);
+    }
+
+    // The manifest goes last, so a save that fails partway isn't loadable.
+    std::vector<uint64_t> manifest = {
+        MAGIC, different_bits_, permutations_.size(), segments.size()
+    };
+    std::vector<uint64_t> tables = describe(permutations_);
+    manifest.insert(manifest.end(), tables.begin(), tables.end());
+    std::string name = directory + "/index";
+    std::FILE* file = std::fopen(name.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Could not open " + name);
+    }
+    bool written =
+        std::fwrite(manifest.data(), sizeof(uint64_t), manifest.size(), file) == manifest.size();
+    if (std::fclose(file) != 0 || !written) {
+        throw std::runtime_error("Could not write " + name);
+    }
+}
+
+void Simhash::Index::load(const std::string& directory)
+{
+    // The tables are only read if there are as many as expected, since
+    // otherwise they can't match anyway.
+    uint64_t manifest[MANIFEST];
+    std::vector<uint64_t> expected = describe(permutations_);
+    std::vector<uint64_t> tables;
+    std::string name = directory + "/index";
+    std::FILE* file = std::fopen(name.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Could not open " + name);
+    }
+    bool valid = std::fread(manifest, sizeof(uint64_t), MANIFEST, file) == MANIFEST &&
+        manifest[0] == MAGIC;
+    bool matching = valid &&
+        manifest[1] == different_bits_ &&
+        manifest[2] == permutations_.size();
+    if (matching) {
+        tables.resize(expected.size());
+        valid = std::fread(tables.data(), sizeof(uint64_t), tables.size(), file) == tables.size();
+    }
+    std::fclose(file);
+    if (!valid) {
+        throw std::runtime_error("Invalid manifest " + name);
+    }
+    if (!matching || tables != expected) {
+        throw std::invalid_argument(
+            "Index under " + directory + " was saved with different parameters");
+    }
+
+    std::vector<Segment::ptr_t> loaded;
+    for (size_t i = 0; i < manifest[3]; ++i) {
+        loaded.push_back(Segment::ptr_t(
+            new Segment(segment_prefix(directory, i), permutations_, pool_)));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Version> next(new Version(*version_));
+    for (auto it = loaded.begin(); it != loaded.end(); ++it) {
+        if ((*it)->size()) {
+            next->segments.push_back(*it);
+        }
+    }
+    publish(next);
+
+    // The new segments may need merging with the existing ones.
+    busy_ = true;
+    wake_.notify_one();
+}
+
+size_t Simhash::Index::size() const
+{
+    Epochs::Guard guard(epochs_);
+    const Version& version = *current_.load();
+    size_t total = version.memtable->size() - version.memtable->dead().count();
+    for (auto it = version.sealed.begin(); it != version.sealed.end(); ++it) {
+        total += (*it)->size() - (*it)->dead().count();
+    }
+    for (auto it = version.segments.begin(); it != version.segments.end(); ++it) {
+        total += (*it)->size() - (*it)->dead();
+    }
+    return total;
+}
+
+size_t Simhash::Index::segments() const
+{
+    Epochs::Guard guard(epochs_);
+    return current_.load()->segments.size();
+}
+
+void Simhash::Index::publish(std::shared_ptr<const Simhash::Index::Version> version)
+{
+    std::shared_ptr<const Version> previous = version_;
+    version_ = version;
+    current_.store(version_.get());
+    epochs_.retire(previous);
+}
+
+void Simhash::Index::seal()
+{
+    std::shared_ptr<Version> next(new Version(*version_));
+    next->sealed.push_back(next->memtable);
+    next->memtable.reset(new Memtable(memtable_capacity_));
+    publish(next);
+
+    busy_ = true;
+    wake_.notify_one();
+}
+
+std::vector<size_t> Simhash::Index::choose_merge() const
+{
+    // A segment's tier is how many merges it took to build, which is roughly
+    // log_merge_factor of its size in memtables. Merge merge_factor segments
+    // from the lowest tier that has that many.
+    auto tier = [this](size_t size) {
+        size_t result = 0;
+        for (size_t bound = memtable_capacity_ * merge_factor_;
+             size >= bound; bound *= merge_factor_) {
+            ++result;
+        }
+        return result;
+    };
+
+    const std::vector<Segment::ptr_t>& segments = version_->segments;
+    std::vector<std::vector<size_t> > tiers;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        size_t current = tier(segments[i]->size());
+        if (tiers.size() <= current) {
+            tiers.resize(current + 1);
+        }
+        tiers[current].push_back(i);
+    }
+
+    for (auto it = tiers.begin(); it != tiers.end(); ++it) {
+        if (it->size() >= merge_factor_) {
+            it->resize(merge_factor_);
+            return *it;
+        }
+    }
+    return std::vector<size_t>();
+}
+
+std::vector<size_t> Simhash::Index::choose_compaction() const
+{
+    const std::vector<Segment::ptr_t>& segments = version_->segments;
+    std::vector<size_t> result;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        size_t dead = segments[i]->dead();
+        if (dead && (compacting_ || dead * 4 >= segments[i]->size())) {
+            result.push_back(i);
+            break;
+        }
+    }
+    return result;
+}
+
+void Simhash::Index::replay_removed(Simhash::Segment& segment)
+{
+    building_ = false;
+    for (auto it = removed_.begin(); it != removed_.end(); ++it) {
+        segment.remove(it->first, it->second);
+    }
+    removed_.clear();
+}
+
+void Simhash::Index::rebuild(std::unique_lock<std::mutex>& lock,
+                             const std::vector<size_t>& positions)
+{
+    std::vector<Segment::ptr_t> inputs;
+    for (auto it = positions.begin(); it != positions.end(); ++it) {
+        inputs.push_back(version_->segments[*it]);
+    }
+    building_ = true;
+    lock.unlock();
+    Segment::ptr_t rebuilt(new Segment(inputs, permutations_, pool_));
+    lock.lock();
+    replay_removed(*rebuilt);
+
+    // Only this thread changes the segments, so the positions are still
+    // valid. They're in increasing order, so erase from the back.
+    std::shared_ptr<Version> next(new Version(*version_));
+    for (auto it = positions.rbegin(); it != positions.rend(); ++it) {
+        next->segments.erase(next->segments.begin() + *it);
+    }
+    if (rebuilt->size()) {
+        next->segments.push_back(rebuilt);
+    }
+    publish(next);
+}
+
+std::string Simhash::Index::segment_prefix(const std::string& directory, size_t i)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/segment-%zu", i);
+    return directory + name;
+}
+
+bool Simhash::Index::work(std::unique_lock<std::mutex>& lock)
+{
+    if (!version_->sealed.empty()) {
+        std::shared_ptr<Memtable> memtable = version_->sealed.front();
+        building_ = true;
+        lock.unlock();
+        Segment::ptr_t segment(new Segment(*memtable, permutations_, pool_));
+        lock.lock();
+        replay_removed(*segment);
+
+        // Swap the memtable for its segment in one version, so that
+        // queries see its entries in exactly one place.
+        std::shared_ptr<Version> next(new Version(*version_));
+        next->sealed.erase(next->sealed.begin());
+        if (segment->size()) {
+            next->segments.push_back(segment);
+        }
+        publish(next);
+        return true;
+    }
+
+    std::vector<size_t> positions = choose_merge();
+    if (positions.empty()) {
+        positions = choose_compaction();
+    }
+    if (!positions.empty()) {
+        rebuild(lock, positions);
+        return true;
+    }
+    return false;
+}
+
+void Simhash::Index::rethrow()
+{
+    if (failure_) {
+        std::exception_ptr failure = failure_;
+        failure_ = std::exception_ptr();
+        std::rethrow_exception(failure);
+    }
+}
+
+void Simhash::Index::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        try {
+            if (!failure_ && work(lock)) {
+                continue;
+            }
+        } catch (...) {
+            // Nothing is installed until its segment is built, so whatever
+            // it was built from is still in the current version. Leave it
+            // there and stop until a writer has heard about the failure.
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            building_ = false;
+            removed_.clear();
+            failure_ = std::current_exception();
+        }
+
+        compacting_ = false;
+        busy_ = false;
+        idle_.notify_all();
+        if (stopping_) {
+            return;
+        }
+        wake_.wait(lock);
+    }
+}
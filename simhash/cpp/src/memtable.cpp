@@ -0,0 +1,63 @@
+#include <stdexcept>
+
+#include "memtable.h"
+
+Simhash::Memtable::Memtable(size_t capacity)
+    : capacity_(capacity)
+    , hashes_(new hash_t[capacity])
+    , ids_(new doc_id_t[capacity])
+    , size_(0)
+    , dead_(capacity)
+{
+    if (capacity == 0) {
+        throw std::invalid_argument("Memtable capacity must be positive");
+    }
+}
+
+void Simhash::Memtable::insert(Simhash::hash_t hash, Simhash::doc_id_t id)
+{
+    size_t position = size_.load(std::memory_order_relaxed);
+    hashes_[position] = hash;
+    ids_[position] = id;
+    size_.store(position + 1, std::memory_order_release);
+}
+
+size_t Simhash::Memtable::remove(Simhash::hash_t hash, Simhash::doc_id_t id)
+{
+    size_t removed = 0;
+    size_t count = size();
+    for (size_t i = 0; i < count; ++i) {
+        if (hashes_[i] == hash && ids_[i] == id && dead_.set(i)) {
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+void Simhash::Memtable::find(Simhash::hash_t query,
+                             size_t different_bits,
+                             std::vector<Simhash::entry_t>& results) const
+{
+    const hash_t* hashes = hashes_.get();
+    size_t count = size();
+    for (size_t i = 0; i < count; ++i) {
+        if (static_cast<size_t>(__builtin_popcountll(hashes[i] ^ query)) <= different_bits &&
+            !dead_.test(i)) {
+            results.push_back(entry_t(hashes[i], ids_[i]));
+        }
+    }
+}
+
+void Simhash::Memtable::find(Simhash::hash_t query,
+                             size_t different_bits,
+                             std::vector<Simhash::neighbor_t>& results) const
+{
+    const hash_t* hashes = hashes_.get();
+    size_t count = size();
+    for (size_t i = 0; i < count; ++i) {
+        size_t distance = static_cast<size_t>(__builtin_popcountll(hashes[i] ^ query));
+        if (distance <= different_bits && !dead_.test(i)) {
+            results.push_back(neighbor_t(distance, entry_t(hashes[i], ids_[i])));
+        }
+    }
+}
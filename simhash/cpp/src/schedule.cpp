@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <stdexcept>
+
+#include "schedule.h"
+
+namespace {
+    /**
+     * The most (table, choice of blocks) pairs considered for any one
+     * distance. Past this, the order is left as it is.
+     */
+    const size_t LIMIT = 1 << 20;
+
+    /**
+     * The number of random choices of bits that recall is estimated from,
+     * when there are too many sets of blocks to count exactly.
+     */
+    const size_t RECALL_SAMPLE = 1 << 16;
+
+    /**
+     * The number of ways to choose k of n, or LIMIT if it's any more.
+     */
+    size_t choose(size_t n, size_t k)
+    {
+        size_t result = 1;
+        for (size_t i = 0; i < k; ++i) {
+            result = result * (n - i) / (i + 1);
+            if (result >= LIMIT) {
+                return LIMIT;
+            }
+        }
+        return result;
+    }
+
+    /**
+     * The number of ways to choose k of n, as a double.
+     */
+    double binomial(size_t n, size_t k)
+    {
+        if (k > n) {
+            return 0;
+        }
+        double result = 1;
+        for (size_t i = 0; i < k; ++i) {
+            result = result * static_cast<double>(n - i) / static_cast<double>(i + 1);
+        }
+        return result;
+    }
+
+    /**
+     * Advance a set of the first n blocks to the next larger one with as many
+     * blocks, returning false if there isn't one.
+     */
+    bool next_choice(Simhash::hash_t& choice, size_t n)
+    {
+        Simhash::hash_t lowest = choice & (~choice + 1);
+        Simhash::hash_t ripple = choice + lowest;
+        if (ripple == 0) {
+            return false;
+        }
+        choice = ripple | (((ripple ^ choice) >> 2) / lowest);
+        return n >= 64 || choice < (Simhash::hash_t(1) << n);
+    }
+
+    /**
+     * The blocks of some permutations, recovered as the sets of bits that are
+     * in exactly the same tables' prefixes, so that this works for any layout.
+     */
+    struct Blocks {
+        explicit Blocks(const std::vector<Simhash::Permutation>& permutations)
+            : prefixes(permutations.size(), 0)
+            , widths()
+            , of(64)
+        {
+            std::vector<Simhash::hash_t> masks;
+            for (auto it = permutations.begin(); it != permutations.end(); ++it) {
+                masks.push_back(it->reverse(it->search_mask()));
+            }
+            std::map<std::vector<bool>, size_t> signatures;
+            for (size_t bit = 0; bit < 64; ++bit) {
+                std::vector<bool> membership(masks.size());
+                for (size_t t = 0; t < masks.size(); ++t) {
+                    membership[t] = (masks[t] >> bit) & 1;
+                }
+                size_t block = signatures.insert(
+                    std::make_pair(membership, signatures.size())).first->second;
+                if (block == widths.size()) {
+                    widths.push_back(0);
+                }
+                ++widths[block];
+                of[bit] = block;
+                for (size_t t = 0; t < masks.size(); ++t) {
+                    if (membership[t]) {
+                        prefixes[t] |= Simhash::hash_t(1) << block;
+                    }
+                }
+            }
+        }
+
+        size_t size() const { return widths.size(); }
+
+        /**
+         * Each table's prefix, as a set of blocks.
+         */
+        std::vector<Simhash::hash_t> prefixes;
+
+        /**
+         * The number of bits in each block.
+         */
+        std::vector<size_t> widths;
+
+        /**
+         * The block each bit is in.
+         */
+        std::vector<size_t> of;
+    };
+
+    /**
+     * The recall at each number of bits up to different_bits of the tables
+     * with these prefixes, as sets of blocks.
+     */
+    std::vector<double> recall_of(const Blocks& blocks,
+                                  const std::vector<Simhash::hash_t>& prefixes,
+                                  size_t different_bits)
+    {
+        std::vector<double> result(different_bits + 1, 0);
+        if (prefixes.empty()) {
+            return result;
+        }
+        result[0] = 1;
+
+        // Whether some table's prefix avoids every block in a set.
+        auto covered = [&](Simhash::hash_t set) {
+            for (auto it = prefixes.begin(); it != prefixes.end(); ++it) {
+                if ((*it & set) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        size_t n = blocks.size();
+        for (size_t d = 1; d <= different_bits; ++d) {
+            bool exact = true;
+            for (size_t j = 1; j <= d && j <= n; ++j) {
+                exact = exact && choose(n, j) * prefixes.size() < LIMIT;
+            }
+
+            if (exact) {
+                // The ways for d bits to fall in exactly the blocks of each
+                // covered set, by inclusion-exclusion over its subsets.
+                double found = 0;
+                for (size_t j = 1; j <= d && j <= n; ++j) {
+                    Simhash::hash_t set = (Simhash::hash_t(1) << j) - 1;
+                    do {
+                        if (!covered(set)) {
+                            continue;
+                        }
+                        for (Simhash::hash_t subset = set; ; subset = (subset - 1) & set) {
+                            size_t width = 0;
+                            for (size_t b = 0; b < n; ++b) {
+                                width += ((subset >> b) & 1) ? blocks.widths[b] : 0;
+                            }
+                            double ways = binomial(width, d);
+                            found += (__builtin_popcountll(set ^ subset) & 1) ? -ways : ways;
+                            if (!subset) {
+                                break;
+                            }
+                        }
+                    } while (next_choice(set, n));
+                }
+                result[d] = found / binomial(64, d);
+            } else {
+                std::mt19937_64 random(d);
+                size_t hits = 0;
+                for (size_t i = 0; i < RECALL_SAMPLE; ++i) {
+                    Simhash::hash_t bits = 0;
+                    while (static_cast<size_t>(__builtin_popcountll(bits)) < d) {
+                        bits |= Simhash::hash_t(1) << (random() % 64);
+                    }
+                    Simhash::hash_t set = 0;
+                    for (size_t bit = 0; bit < 64; ++bit) {
+                        if ((bits >> bit) & 1) {
+                            set |= Simhash::hash_t(1) << blocks.of[bit];
+                        }
+                    }
+                    hits += covered(set);
+                }
+                result[d] = static_cast<double>(hits) / static_cast<double>(RECALL_SAMPLE);
+            }
+        }
+        return result;
+    }
+}
+
+std::vector<size_t> Simhash::schedule(std::vector<Simhash::Permutation>& permutations,
+                                      size_t different_bits)
+{
+    size_t tables = permutations.size();
+    std::vector<size_t> coverage(different_bits + 1, tables);
+    if (tables == 0) {
+        return coverage;
+    }
+    coverage[0] = 1;
+
+    Blocks blocks(permutations);
+    const std::vector<hash_t>& prefix_blocks = blocks.prefixes;
+    size_t number_of_blocks = blocks.size();
+
+    std::vector<size_t> order;
+    std::vector<bool> scheduled(tables, false);
+    for (size_t d = 1; d <= different_bits && d <= number_of_blocks; ++d) {
+        if (choose(number_of_blocks, d) * tables >= LIMIT) {
+            break;
+        }
+
+        // Every choice of d blocks that could hold all the differing bits,
+        // which some table's prefix has to avoid.
+        std::vector<hash_t> uncovered;
+        hash_t choice = (hash_t(1) << d) - 1;
+        do {
+            bool covered = false;
+            for (auto it = order.begin(); it != order.end() && !covered; ++it) {
+                covered = (prefix_blocks[*it] & choice) == 0;
+            }
+            if (!covered) {
+                uncovered.push_back(choice);
+            }
+        } while (next_choice(choice, number_of_blocks));
+
+        // Greedily take whichever table avoids the most remaining choices.
+        while (!uncovered.empty()) {
+            size_t best = tables;
+            size_t best_count = 0;
+            for (size_t t = 0; t < tables; ++t) {
+                if (scheduled[t]) {
+                    continue;
+                }
+                size_t count = 0;
+                for (auto it = uncovered.begin(); it != uncovered.end(); ++it) {
+                    count += (prefix_blocks[t] & *it) == 0;
+                }
+                if (count > best_count) {
+                    best = t;
+                    best_count = count;
+                }
+            }
+            if (best == tables) {
+                break;
+            }
+
+            scheduled[best] = true;
+            order.push_back(best);
+            size_t kept = 0;
+            for (size_t i = 0; i < uncovered.size(); ++i) {
+                if (prefix_blocks[best] & uncovered[i]) {
+                    uncovered[kept++] = uncovered[i];
+                }
+            }
+            uncovered.resize(kept);
+        }
+        if (!uncovered.empty()) {
+            break;
+        }
+        coverage[d] = order.size();
+    }
+
+    for (size_t t = 0; t < tables; ++t) {
+        if (!scheduled[t]) {
+            order.push_back(t);
+        }
+    }
+    std::vector<Permutation> reordered;
+    for (auto it = order.begin(); it != order.end(); ++it) {
+        reordered.push_back(permutations[*it]);
+    }
+    permutations.swap(reordered);
+    return coverage;
+}
+
+std::vector<double> Simhash::recall(const std::vector<Simhash::Permutation>& permutations,
+                                   size_t different_bits)
+{
+    Blocks blocks(permutations);
+    return recall_of(blocks, blocks.prefixes, different_bits);
+}
+
+bool Simhash::complete(const std::vector<Simhash::Permutation>& permutations,
+                       size_t different_bits)
+{
+    // Distinct prefixes of all but different_bits blocks, as many as there
+    // are ways to choose the blocks left out, must be all of them.
+    Blocks blocks(permutations);
+    if (blocks.size() < different_bits ||
+        static_cast<double>(permutations.size()) != binomial(blocks.size(), different_bits)) {
+        return false;
+    }
+    std::vector<hash_t> prefixes = blocks.prefixes;
+    for (auto it = prefixes.begin(); it != prefixes.end(); ++it) {
+        if (static_cast<size_t>(__builtin_popcountll(*it)) != blocks.size() - different_bits) {
+            return false;
+        }
+    }
+    std::sort(prefixes.begin(), prefixes.end());
+    return std::unique(prefixes.begin(), prefixes.end()) == prefixes.end();
+}
+
+std::vector<size_t> Simhash::choose_tables(const std::vector<Simhash::Permutation>& permutations,
+                                           size_t different_bits,
+                                           size_t count)
+{
+    if (count > permutations.size()) {
+        throw std::invalid_argument("Can't choose more tables than there are");
+    }
+    Blocks blocks(permutations);
+    std::vector<size_t> chosen;
+    std::vector<hash_t> prefixes;
+    std::vector<bool> taken(permutations.size(), false);
+    while (chosen.size() < count) {
+        // Compared from different_bits down, so that ties are broken by the
+        // recall at fewer bits.
+        size_t best = permutations.size();
+        std::vector<double> best_recall;
+        for (size_t t = 0; t < permutations.size(); ++t) {
+            if (taken[t]) {
+                continue;
+            }
+            prefixes.push_back(blocks.prefixes[t]);
+            std::vector<double> candidate = recall_of(blocks, prefixes, different_bits);
+            prefixes.pop_back();
+            if (best == permutations.size() ||
+                std::lexicographical_compare(best_recall.rbegin(), best_recall.rend(),
+                                             candidate.rbegin(), candidate.rend())) {
+                best = t;
+                best_recall.swap(candidate);
+            }
+        }
+        taken[best] = true;
+        chosen.push_back(best);
+        prefixes.push_back(blocks.prefixes[best]);
+    }
+    return chosen;
+}
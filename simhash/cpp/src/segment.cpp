@@ -0,0 +1,568 @@
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "segment.h"
+
+namespace {
+    /**
+     * Marks a position that doesn't survive into a rebuilt segment.
+     */
+    const uint32_t DROPPED = std::numeric_limits<uint32_t>::max();
+
+    /**
+     * The first word of every table file, "SIMHASH2" in ASCII.
+     */
+    const uint64_t MAGIC = 0x32485341484d4953ULL;
+
+    /**
+     * The number of words in a table file's header: the magic number, the
+     * table, the number of tables, the table's search mask, its permutation's
+     * layout and the number of rows. The header is followed by a directory of
+     * SHARDS + 1 words, the row at which each shard starts and then the end,
+     * and then by two words per row.
+     */
+    const size_t HEADER = 4 + Simhash::LAYOUT_WORDS + 1;
+
+    /**
+     * The offset of the first row in a table file, in words.
+     */
+    const size_t ROWS = HEADER + Simhash::Segment::SHARDS + 1;
+
+    /**
+     * The header of a table file, or what it should be, other than its magic
+     * number and number of rows.
+     */
+    void describe(const Simhash::Permutation& permutation,
+                  size_t table,
+                  size_t tables,
+                  uint64_t* header)
+    {
+        header[1] = table;
+        header[2] = tables;
+        header[3] = permutation.search_mask();
+        Simhash::layout_of(permutation, header + 4);
+    }
+
+    /**
+     * A file open for writing at any offset from several threads at once,
+     * closed when it goes out of scope, that throws whenever something goes
+     * wrong.
+     */
+    class Output {
+    public:
+        explicit Output(const std::string& name)
+            : name_(name)
+            , fd_(::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644))
+        {
+            if (fd_ < 0) {
+                throw std::runtime_error("Could not open " + name);
+            }
+        }
+
+        ~Output()
+        {
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+
+        Output(const Output&) = delete;
+        Output& operator=(const Output&) = delete;
+
+        /**
+         * Write count words at this offset, in words.
+         */
+        void write(const uint64_t* words, size_t count, size_t offset)
+        {
+            const char* data = reinterpret_cast<const char*>(words);
+            size_t bytes = count * sizeof(uint64_t);
+            off_t at = static_cast<off_t>(offset * sizeof(uint64_t));
+            while (bytes) {
+                ssize_t written = ::pwrite(fd_, data, bytes, at);
+                if (written <= 0) {
+                    throw std::runtime_error("Could not write " + name_);
+                }
+                data += written;
+                bytes -= static_cast<size_t>(written);
+                at += written;
+            }
+        }
+
+        void close()
+        {
+            int fd = fd_;
+            fd_ = -1;
+            if (::close(fd) != 0) {
+                throw std::runtime_error("Could not write " + name_);
+            }
+        }
+
+    private:
+        std::string name_;
+        int fd_;
+    };
+
+    inline size_t shard_of(Simhash::hash_t key)
+    {
+        return static_cast<size_t>(key >> 56);
+    }
+}
+
+Simhash::Segment::Segment(const Simhash::Memtable& memtable,
+                          const std::vector<Simhash::Permutation>& permutations,
+                          Simhash::Pool& pool)
+    : permutations_(permutations)
+    , hashes_()
+    , ids_()
+    , tables_()
+    , by_hash_()
+    , dead_()
+{
+    const Tombstones& dead = memtable.dead();
+    for (size_t i = 0; i < memtable.size(); ++i) {
+        if (!dead.test(i)) {
+            hashes_.push_back(memtable.hashes()[i]);
+            ids_.push_back(memtable.ids()[i]);
+        }
+    }
+    build(pool);
+}
+
+Simhash::Segment::Segment(const std::vector<Simhash::Segment::ptr_t>& segments,
+                          const std::vector<Simhash::Permutation>& permutations,
+                          Simhash::Pool& pool)
+    : permutations_(permutations)
+    , hashes_()
+    , ids_()
+    , tables_(permutations.size())
+    , by_hash_()
+    , dead_()
+{
+    // Read each input's tombstones exactly once, recording where each of its
+    // live entries ends up. Entries removed after this point are caught by
+    // the caller, so the inputs may keep changing while the merge runs.
+    std::vector<std::vector<uint32_t> > remaps(segments.size());
+    for (size_t s = 0; s < segments.size(); ++s) {
+        const Segment& segment = *segments[s];
+        std::vector<uint32_t>& remap = remaps[s];
+        remap.resize(segment.size());
+        for (size_t i = 0; i < segment.size(); ++i) {
+            if (segment.dead_->test(i)) {
+                remap[i] = DROPPED;
+                continue;
+            }
+            if (hashes_.size() >= DROPPED) {
+                throw std::length_error("Too many entries for a single segment");
+            }
+            remap[i] = static_cast<uint32_t>(hashes_.size());
+            hashes_.push_back(segment.hashes_[i]);
+            ids_.push_back(segment.ids_[i]);
+        }
+    }
+    dead_.reset(new Tombstones(hashes_.size()));
+
+    // Count the surviving rows of each (table, shard) pair, so that every
+    // pair can then be merged straight into its place independently.
+    for (auto it = tables_.begin(); it != tables_.end(); ++it) {
+        it->shards.assign(SHARDS + 1, 0);
+    }
+    pool.run(tables_.size() * SHARDS, [&](size_t task) {
+        size_t t = task / SHARDS;
+        size_t shard = task % SHARDS;
+        size_t count = 0;
+        for (size_t s = 0; s < segments.size(); ++s) {
+            const Table& source = segments[s]->tables_[t];
+            for (size_t i = source.shards[shard]; i < source.shards[shard + 1]; ++i) {
+                count += (remaps[s][source.positions[i]] != DROPPED);
+            }
+        }
+        tables_[t].shards[shard + 1] = count;
+    });
+    for (auto it = tables_.begin(); it != tables_.end(); ++it) {
+        for (size_t shard = 0; shard < SHARDS; ++shard) {
+            it->shards[shard + 1] += it->shards[shard];
+        }
+        it->keys.resize(hashes_.size());
+        it->positions.resize(hashes_.size());
+    }
+
+    // Each input shard is already sorted, so merge rather than re-sort.
+    typedef std::pair<hash_t, size_t> head_t;
+    pool.run(tables_.size() * SHARDS, [&](size_t task) {
+        size_t t = task / SHARDS;
+        size_t shard = task % SHARDS;
+        Table& table = tables_[t];
+
+        std::vector<size_t> cursors(segments.size());
+        std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t> > heads;
+        for (size_t s = 0; s < segments.size(); ++s) {
+            const Table& source = segments[s]->tables_[t];
+            cursors[s] = source.shards[shard];
+            if (cursors[s] < source.shards[shard + 1]) {
+                heads.push(head_t(source.keys[cursors[s]], s));
+            }
+        }
+
+        size_t out = table.shards[shard];
+        while (!heads.empty()) {
+            size_t s = heads.top().second;
+            heads.pop();
+
+            const Table& source = segments[s]->tables_[t];
+            size_t& cursor = cursors[s];
+            uint32_t position = remaps[s][source.positions[cursor]];
+            if (position != DROPPED) {
+                table.keys[out] = source.keys[cursor];
+                table.positions[out] = position;
+                ++out;
+            }
+            if (++cursor < source.shards[shard + 1]) {
+                heads.push(head_t(source.keys[cursor], s));
+            }
+        }
+    });
+    index_hashes();
+}
+
+Simhash::Segment::Segment(const std::string& prefix,
+                          const std::vector<Simhash::Permutation>& permutations,
+                          Simhash::Pool& pool)
+    : permutations_(permutations)
+    , hashes_()
+    , ids_()
+    , tables_(permutations.size())
+    , by_hash_()
+    , dead_()
+{
+    // Every table holds every entry, each followed by its identifier.
+    std::vector<std::vector<doc_id_t> > ids(tables_.size());
+    pool.run(tables_.size(), [&](size_t t) {
+        Table& table = tables_[t];
+        std::string name = filename(prefix, t);
+        std::FILE* file = std::fopen(name.c_str(), "rb");
+        if (!file) {
+            throw std::runtime_error("Could not open " + name);
+        }
+
+        // The directory and rows have to fill the rest of the file exactly.
+        uint64_t header[HEADER];
+        uint64_t expected[HEADER];
+        describe(permutations_[t], t, tables_.size(), expected);
+        bool valid = std::fread(header, sizeof(uint64_t), HEADER, file) == HEADER &&
+            header[0] == MAGIC &&
+            std::equal(header + 1, header + HEADER - 1, expected + 1) &&
+            std::fseek(file, 0, SEEK_END) == 0;
+        long bytes = valid ? std::ftell(file) : -1;
+        valid = valid &&
+            bytes >= 0 &&
+            static_cast<uint64_t>(bytes) / sizeof(uint64_t) >= ROWS &&
+            (static_cast<uint64_t>(bytes) / sizeof(uint64_t) - ROWS) / 2 == header[HEADER - 1] &&
+            static_cast<uint64_t>(bytes) == (ROWS + 2 * header[HEADER - 1]) * sizeof(uint64_t) &&
+            std::fseek(file, HEADER * sizeof(uint64_t), SEEK_SET) == 0;
+
+        std::vector<uint64_t> shards(valid ? SHARDS + 1 : 0);
+        std::vector<uint64_t> rows(valid ? header[HEADER - 1] * 2 : 0);
+        valid = valid &&
+            std::fread(shards.data(), sizeof(uint64_t), shards.size(), file) == shards.size() &&
+            std::fread(rows.data(), sizeof(uint64_t), rows.size(), file) == rows.size();
+        std::fclose(file);
+        for (size_t shard = 0; valid && shard < SHARDS; ++shard) {
+            valid = shards[shard] <= shards[shard + 1];
+        }
+        if (!valid || shards[0] != 0 || shards[SHARDS] != header[HEADER - 1]) {
+            throw std::runtime_error("Invalid table file " + name);
+        }
+
+        table.shards.assign(shards.begin(), shards.end());
+        table.keys.resize(rows.size() / 2);
+        ids[t].resize(rows.size() / 2);
+        for (size_t i = 0; i < rows.size(); i += 2) {
+            table.keys[i / 2] = rows[i];
+            ids[t][i / 2] = rows[i + 1];
+        }
+    });
+
+    // The first table defines the positions of the entries, and the rest are
+    // resolved against it.
+    size_t count = tables_[0].keys.size();
+    for (auto it = tables_.begin(); it != tables_.end(); ++it) {
+        if (it->keys.size() != count) {
+            throw std::runtime_error("Shard files under " + prefix + " disagree");
+        }
+    }
+    if (count >= DROPPED) {
+        throw std::length_error("Too many entries for a single segment");
+    }
+
+    hashes_.resize(count);
+    ids_ = ids[0];
+    tables_[0].positions.resize(count);
+    typedef std::pair<entry_t, uint32_t> located_t;
+    std::vector<located_t> located(count);
+    for (size_t i = 0; i < count; ++i) {
+        hashes_[i] = permutations_[0].reverse(tables_[0].keys[i]);
+        tables_[0].positions[i] = static_cast<uint32_t>(i);
+        located[i] = located_t(entry_t(hashes_[i], ids_[i]), static_cast<uint32_t>(i));
+    }
+    std::sort(located.begin(), located.end());
+
+    pool.run(tables_.size() - 1, [&](size_t task) {
+        size_t t = task + 1;
+        Table& table = tables_[t];
+        table.positions.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            entry_t entry(permutations_[t].reverse(table.keys[i]), ids[t][i]);
+            auto it = std::lower_bound(
+                located.begin(), located.end(), located_t(entry, 0));
+            if (it == located.end() || it->first != entry) {
+                throw std::runtime_error("Shard files under " + prefix + " disagree");
+            }
+            table.positions[i] = it->second;
+        }
+    });
+
+    dead_.reset(new Tombstones(count));
+    index_hashes();
+}
+
+void Simhash::Segment::save(const std::string& prefix, Simhash::Pool& pool) const
+{
+    // Take one snapshot of the tombstones so that every table agrees.
+    std::vector<bool> dead(hashes_.size());
+    for (size_t i = 0; i < hashes_.size(); ++i) {
+        dead[i] = dead_->test(i);
+    }
+
+    // Count the live rows of each shard first, so that every (table, shard)
+    // pair knows where in its table's file to write them.
+    std::vector<std::vector<uint64_t> > directories(tables_.size());
+    std::vector<std::unique_ptr<Output> > files(tables_.size());
+    pool.run(tables_.size(), [&](size_t t) {
+        const Table& table = tables_[t];
+        std::vector<uint64_t>& directory = directories[t];
+        directory.assign(SHARDS + 1, 0);
+        for (size_t shard = 0; shard < SHARDS; ++shard) {
+            size_t live = 0;
+            for (size_t i = table.shards[shard]; i < table.shards[shard + 1]; ++i) {
+                live += !dead[table.positions[i]];
+            }
+            directory[shard + 1] = directory[shard] + live;
+        }
+
+        uint64_t header[HEADER];
+        header[0] = MAGIC;
+        describe(permutations_[t], t, tables_.size(), header);
+        header[HEADER - 1] = directory[SHARDS];
+        files[t].reset(new Output(filename(prefix, t)));
+        files[t]->write(header, HEADER, 0);
+        files[t]->write(directory.data(), directory.size(), HEADER);
+    });
+
+    pool.run(tables_.size() * SHARDS, [&](size_t task) {
+        size_t t = task / SHARDS;
+        size_t shard = task % SHARDS;
+        const Table& table = tables_[t];
+
+        std::vector<uint64_t> words;
+        words.reserve(2 * (directories[t][shard + 1] - directories[t][shard]));
+        for (size_t i = table.shards[shard]; i < table.shards[shard + 1]; ++i) {
+            uint32_t position = table.positions[i];
+            if (!dead[position]) {
+                words.push_back(table.keys[i]);
+                words.push_back(ids_[position]);
+            }
+        }
+        files[t]->write(words.data(), words.size(), ROWS + 2 * directories[t][shard]);
+    });
+
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        (*it)->close();
+    }
+}
+
+std::string Simhash::Segment::filename(const std::string& prefix, size_t table)
+{
+    char suffix[64];
+    std::snprintf(suffix, sizeof(suffix), "-table-%zu", table);
+    return prefix + suffix;
+}
+
+void Simhash::Segment::build(Simhash::Pool& pool)
+{
+    if (hashes_.size() >= DROPPED) {
+        throw std::length_error("Too many entries for a single segment");
+    }
+    dead_.reset(new Tombstones(hashes_.size()));
+
+    // First scatter each table's rows into their shards, then sort every
+    // (table, shard) pair on its own.
+    size_t count = hashes_.size();
+    std::vector<std::vector<std::pair<hash_t, uint32_t> > > rows(permutations_.size());
+    tables_.resize(permutations_.size());
+    pool.run(tables_.size(), [&](size_t t) {
+        const Permutation& permutation = permutations_[t];
+        Table& table = tables_[t];
+        std::vector<hash_t> keys(count);
+        table.shards.assign(SHARDS + 1, 0);
+        for (size_t i = 0; i < count; ++i) {
+            keys[i] = permutation.apply(hashes_[i]);
+            ++table.shards[shard_of(keys[i]) + 1];
+        }
+        for (size_t shard = 0; shard < SHARDS; ++shard) {
+            table.shards[shard + 1] += table.shards[shard];
+        }
+
+        std::vector<size_t> cursors(table.shards.begin(), table.shards.end() - 1);
+        rows[t].resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            rows[t][cursors[shard_of(keys[i])]++] =
+                std::make_pair(keys[i], static_cast<uint32_t>(i));
+        }
+        table.keys.resize(count);
+        table.positions.resize(count);
+    });
+
+    pool.run(tables_.size() * SHARDS, [&](size_t task) {
+        size_t t = task / SHARDS;
+        size_t shard = task % SHARDS;
+        Table& table = tables_[t];
+        auto begin = rows[t].begin();
+        std::sort(begin + table.shards[shard], begin + table.shards[shard + 1]);
+        for (size_t i = table.shards[shard]; i < table.shards[shard + 1]; ++i) {
+            table.keys[i] = rows[t][i].first;
+            table.positions[i] = rows[t][i].second;
+        }
+    });
+    index_hashes();
+}
+
+void Simhash::Segment::index_hashes()
+{
+    // Equal hashes have equal permuted keys, so they're adjacent in every
+    // table.
+    if (tables_.empty()) {
+        return;
+    }
+    const Table& table = tables_[0];
+    by_hash_ = HashTable(table.keys.size(), [&](size_t row) {
+        return hashes_[table.positions[row]];
+    });
+}
+
+size_t Simhash::Segment::remove(Simhash::hash_t hash, Simhash::doc_id_t id)
+{
+    if (tables_.empty()) {
+        return 0;
+    }
+
+    // Every entry appears in the first table, under its full permuted hash.
+    const Table& table = tables_[0];
+    hash_t key = permutations_[0].apply(hash);
+    size_t shard = shard_of(key);
+    auto range = std::equal_range(table.keys.begin() + table.shards[shard],
+                                  table.keys.begin() + table.shards[shard + 1],
+                                  key);
+
+    size_t removed = 0;
+    for (auto it = range.first; it != range.second; ++it) {
+        uint32_t position = table.positions[it - table.keys.begin()];
+        if (ids_[position] == id && dead_->set(position)) {
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+template <typename Emit>
+void Simhash::Segment::scan(Simhash::hash_t query,
+                            size_t different_bits,
+                            size_t begin,
+                            size_t end,
+                            Emit emit) const
+{
+    for (size_t t = begin; t < end && t < tables_.size(); ++t) {
+        const Permutation& permutation = permutations_[t];
+        const Table& table = tables_[t];
+        hash_t mask = permutation.search_mask();
+        hash_t key = permutation.apply(query);
+        hash_t prefix = key & mask;
+
+        // Only the shards whose leading byte can carry the prefix need to
+        // be searched, which is just one unless the prefix is under 8 bits.
+        auto first = table.keys.begin() + table.shards[shard_of(prefix)];
+        auto last = table.keys.begin() + table.shards[shard_of(prefix | ~mask) + 1];
+        auto it = std::lower_bound(first, last, prefix);
+        for (; it != last && (*it & mask) == prefix; ++it) {
+            size_t distance = static_cast<size_t>(__builtin_popcountll(*it ^ key));
+            if (distance <= different_bits) {
+                uint32_t position = table.positions[it - table.keys.begin()];
+                if (!dead_->test(position)) {
+                    emit(distance, position);
+                }
+            }
+        }
+    }
+}
+
+void Simhash::Segment::find(Simhash::hash_t query,
+                            size_t different_bits,
+                            std::vector<Simhash::entry_t>& results) const
+{
+    scan(query, different_bits, 0, tables_.size(), [&](size_t, uint32_t position) {
+        results.push_back(entry_t(hashes_[position], ids_[position]));
+    });
+}
+
+void Simhash::Segment::find(Simhash::hash_t query,
+                            size_t different_bits,
+                            size_t begin,
+                            size_t end,
+                            std::vector<Simhash::neighbor_t>& results) const
+{
+    scan(query, different_bits, begin, end, [&](size_t distance, uint32_t position) {
+        results.push_back(neighbor_t(distance, entry_t(hashes_[position], ids_[position])));
+    });
+}
+
+template <typename Emit>
+void Simhash::Segment::visit(Simhash::hash_t query, size_t different_bits, Emit emit) const
+{
+    if (tables_.empty()) {
+        return;
+    }
+    const Table& table = tables_[0];
+    visit_ball(query, different_bits, [&](hash_t hash, size_t distance) {
+        std::pair<size_t, size_t> rows = by_hash_.find(hash);
+        for (size_t row = rows.first; row < rows.second; ++row) {
+            uint32_t position = table.positions[row];
+            if (!dead_->test(position)) {
+                emit(distance, position);
+            }
+        }
+    });
+}
+
+void Simhash::Segment::probe(Simhash::hash_t query,
+                             size_t different_bits,
+                             std::vector<Simhash::entry_t>& results) const
+{
+    visit(query, different_bits, [&](size_t, uint32_t position) {
+        results.push_back(entry_t(hashes_[position], ids_[position]));
+    });
+}
+
+void Simhash::Segment::probe(Simhash::hash_t query,
+                             size_t different_bits,
+                             std::vector<Simhash::neighbor_t>& results) const
+{
+    visit(query, different_bits, [&](size_t distance, uint32_t position) {
+        results.push_back(neighbor_t(distance, entry_t(hashes_[position], ids_[position])));
+    });
+}
@@ -0,0 +1,172 @@
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stoplist.h"
+
+namespace {
+    using Simhash::hash_t;
+
+    /**
+     * The first word of a stoplist file, "SIMHASHS" in ASCII.
+     */
+    const uint64_t MAGIC = 0x53485341484d4953ULL;
+
+    /**
+     * The number of words in a stoplist file's header: the magic number, the
+     * number of slots, the number of hashes besides 0, and whether it has 0.
+     */
+    const size_t HEADER = 4;
+
+    /**
+     * How many hashes ahead filter fetches the slots it will probe, so that
+     * a table larger than the caches doesn't stall on every lookup.
+     */
+    const size_t PREFETCH = 16;
+
+    inline bool is_power_of_two(uint64_t value)
+    {
+        return value && !(value & (value - 1));
+    }
+}
+
+Simhash::Stoplist::Stoplist()
+    : Stoplist(nullptr, 0)
+{
+}
+
+Simhash::Stoplist::Stoplist(const Simhash::hash_t* hashes, size_t count)
+    : owned_()
+    , mapping_(nullptr)
+    , mapped_bytes_(0)
+    , slots_(nullptr)
+    , mask_(0)
+    , shift_(0)
+    , size_(0)
+    , zero_(false)
+{
+    size_t capacity = 2;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    owned_.assign(capacity, 0);
+    use(owned_.data(), capacity, 0, false);
+
+    for (size_t i = 0; i < count; ++i) {
+        hash_t hash = hashes[i];
+        if (hash == 0) {
+            zero_ = true;
+            continue;
+        }
+        size_t slot = home(hash);
+        while (owned_[slot] != 0 && owned_[slot] != hash) {
+            slot = (slot + 1) & mask_;
+        }
+        if (owned_[slot] == 0) {
+            owned_[slot] = hash;
+            ++size_;
+        }
+    }
+}
+
+Simhash::Stoplist::~Stoplist()
+{
+    unmap();
+}
+
+size_t Simhash::Stoplist::filter(const Simhash::hash_t* hashes,
+                                 size_t count,
+                                 Simhash::hash_t* kept) const
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (i + PREFETCH < count) {
+            __builtin_prefetch(slots_ + home(hashes[i + PREFETCH]));
+        }
+        hash_t hash = hashes[i];
+        kept[size] = hash;
+        size += !contains(hash);
+    }
+    return size;
+}
+
+void Simhash::Stoplist::save(const std::string& path) const
+{
+    uint64_t header[HEADER] = {MAGIC, mask_ + 1, size_, zero_};
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    bool written =
+        std::fwrite(header, sizeof(uint64_t), HEADER, file) == HEADER &&
+        std::fwrite(slots_, sizeof(hash_t), mask_ + 1, file) == mask_ + 1;
+    if (std::fclose(file) != 0 || !written) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+void Simhash::Stoplist::load(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Could not read " + path);
+    }
+    size_t bytes = static_cast<size_t>(info.st_size);
+    void* mapping = bytes ? ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Could not map " + path);
+    }
+
+    const uint64_t* words = static_cast<const uint64_t*>(mapping);
+    bool valid = bytes >= HEADER * sizeof(uint64_t) &&
+        words[0] == MAGIC &&
+        is_power_of_two(words[1]) && words[1] >= 2 &&
+        words[1] <= bytes / sizeof(uint64_t) &&
+        bytes == (HEADER + words[1]) * sizeof(uint64_t) &&
+        words[2] < words[1] &&
+        words[3] <= 1;
+    if (!valid) {
+        if (mapping) {
+            ::munmap(mapping, bytes);
+        }
+        throw std::runtime_error("Invalid stoplist file " + path);
+    }
+
+    unmap();
+    owned_.clear();
+    owned_.shrink_to_fit();
+    mapping_ = mapping;
+    mapped_bytes_ = bytes;
+    use(words + HEADER, words[1], words[2], words[3] != 0);
+}
+
+void Simhash::Stoplist::use(const Simhash::hash_t* slots, size_t count, size_t size, bool zero)
+{
+    slots_ = slots;
+    mask_ = count - 1;
+    shift_ = 64;
+    for (size_t capacity = count; capacity > 1; capacity /= 2) {
+        --shift_;
+    }
+    size_ = size;
+    zero_ = zero;
+}
+
+void Simhash::Stoplist::unmap()
+{
+    if (mapping_) {
+        ::munmap(mapping_, mapped_bytes_);
+        mapping_ = nullptr;
+        mapped_bytes_ = 0;
+    }
+}
@@ -0,0 +1,546 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include "compute.h"
+#include "hash.h"
+#include "text.h"
+
+namespace {
+    using Simhash::hash_t;
+
+    /**
+     * The base of the polynomial that combines the tokens of a shingle.
+     */
+    const hash_t BASE = 0x9E3779B97F4A7C15ULL;
+
+    /**
+     * About how long fingerprinting takes per byte of text, for deciding
+     * whether a batch is worth splitting among threads. Measured over
+     * 150KB of short words with three-token shingles.
+     */
+    const size_t NANOSECONDS_PER_BYTE = 8;
+
+    /**
+     * The number of n-gram hashes char_ngrams gathers before adding them to
+     * an accumulator.
+     */
+    const size_t NGRAM_BATCH = 256;
+
+    struct Range {
+        uint32_t first;
+        uint32_t last;
+    };
+
+    /**
+     * The code points beyond ASCII that separate tokens, in order: controls,
+     * whitespace, and the blocks and characters of punctuation and symbols
+     * that text in the common scripts uses.
+     */
+    const Range SEPARATORS[] = {
+        {0x0080, 0x00A9}, {0x00AB, 0x00B4}, {0x00B6, 0x00B9}, {0x00BB, 0x00BF},
+        {0x00D7, 0x00D7}, {0x00F7, 0x00F7}, {0x037E, 0x037E}, {0x0387, 0x0387},
+        {0x055A, 0x055F}, {0x0589, 0x058A}, {0x05BE, 0x05BE}, {0x05C0, 0x05C0},
+        {0x05C3, 0x05C3}, {0x05F3, 0x05F4}, {0x060C, 0x060D}, {0x061B, 0x061B},
+        {0x061F, 0x061F}, {0x066A, 0x066D}, {0x06D4, 0x06D4}, {0x0964, 0x0965},
+        {0x0E4F, 0x0E4F}, {0x0E5A, 0x0E5B}, {0x1680, 0x1680}, {0x2000, 0x206F},
+        {0x20A0, 0x20CF}, {0x2190, 0x2BFF}, {0x2E00, 0x2E7F}, {0x3000, 0x3004},
+        {0x3008, 0x3020}, {0x3030, 0x3030}, {0x303D, 0x303F}, {0xFE10, 0xFE1F},
+        {0xFE30, 0xFE6F}, {0xFEFF, 0xFEFF}, {0xFF00, 0xFF0F}, {0xFF1A, 0xFF20},
+        {0xFF3B, 0xFF40}, {0xFF5B, 0xFF65}, {0x1F000, 0x1FAFF}, {0xE0000, 0xE007F},
+    };
+
+    /**
+     * The blocks of CJK ideographs, each of which is a token.
+     */
+    const Range IDEOGRAPHS[] = {
+        {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xF900, 0xFAFF}, {0x20000, 0x2FA1F},
+    };
+
+    /**
+     * The digit zero of each script whose decimal digits are read as ASCII.
+     */
+    const uint32_t ZEROS[] = {
+        0x0660, 0x06F0, 0x07C0, 0x0966, 0x09E6, 0x0A66, 0x0AE6, 0x0B66, 0x0BE6,
+        0x0C66, 0x0CE6, 0x0D66, 0x0E50, 0x0ED0, 0x0F20, 0x1040, 0x17E0, 0x1810,
+        0xFF10,
+    };
+
+    struct Case {
+        uint32_t upper;
+        uint32_t lower;
+    };
+
+    /**
+     * The capitals of Latin Extended-B outside its runs of alternating
+     * capitals and small letters, in order, each with its small letter.
+     * Titlecase digraphs are folded like capitals.
+     */
+    const Case LATIN_EXTENDED_B[] = {
+        {0x0181, 0x0253}, {0x0182, 0x0183}, {0x0184, 0x0185}, {0x0186, 0x0254},
+        {0x0187, 0x0188}, {0x0189, 0x0256}, {0x018A, 0x0257}, {0x018B, 0x018C},
+        {0x018E, 0x01DD}, {0x018F, 0x0259}, {0x0190, 0x025B}, {0x0191, 0x0192},
+        {0x0193, 0x0260}, {0x0194, 0x0263}, {0x0196, 0x0269}, {0x0197, 0x0268},
+        {0x0198, 0x0199}, {0x019C, 0x026F}, {0x019D, 0x0272}, {0x019F, 0x0275},
+        {0x01A0, 0x01A1}, {0x01A2, 0x01A3}, {0x01A4, 0x01A5}, {0x01A6, 0x0280},
+        {0x01A7, 0x01A8}, {0x01A9, 0x0283}, {0x01AC, 0x01AD}, {0x01AE, 0x0288},
+        {0x01AF, 0x01B0}, {0x01B1, 0x028A}, {0x01B2, 0x028B}, {0x01B3, 0x01B4},
+        {0x01B5, 0x01B6}, {0x01B7, 0x0292}, {0x01B8, 0x01B9}, {0x01BC, 0x01BD},
+        {0x01C4, 0x01C6}, {0x01C5, 0x01C6}, {0x01C7, 0x01C9}, {0x01C8, 0x01C9},
+        {0x01CA, 0x01CC}, {0x01CB, 0x01CC}, {0x01F1, 0x01F3}, {0x01F2, 0x01F3},
+        {0x01F4, 0x01F5}, {0x01F6, 0x0195}, {0x01F7, 0x01BF}, {0x0220, 0x019E},
+        {0x023A, 0x2C65}, {0x023B, 0x023C}, {0x023D, 0x019A}, {0x023E, 0x2C66},
+        {0x0241, 0x0242}, {0x0243, 0x0180}, {0x0244, 0x0289}, {0x0245, 0x028C},
+    };
+
+    template <size_t N>
+    bool in_ranges(const Range (&ranges)[N], uint32_t c)
+    {
+        const Range* range = std::lower_bound(
+            ranges, ranges + N, c,
+            [](const Range& r, uint32_t value) { return r.last < value; });
+        return range != ranges + N && range->first <= c;
+    }
+
+    /**
+     * The lowercase of a letter in a block where capitals and small letters
+     * alternate, with the capitals on even code points if even is true.
+     */
+    inline uint32_t alternating(uint32_t c, bool even)
+    {
+        return c + ((c & 1) != even);
+    }
+
+    /**
+     * The code point c is read as in a token: letters case folded, and
+     * fullwidth forms and other scripts' digits as ASCII.
+     */
+    uint32_t fold(uint32_t c)
+    {
+        if (c < 0x100) {
+            return (c >= 0xC0 && c <= 0xDE && c != 0xD7) ? c + 0x20 : c;
+        }
+        if (c < 0x180) {
+            if (c == 0x130) {
+                return 'i';
+            }
+            if (c == 0x178) {
+                return 0xFF;
+            }
+            if (c == 0x131 || c == 0x138 || c == 0x149 || c == 0x17F) {
+                return c;
+            }
+            return alternating(c, !((c >= 0x139 && c <= 0x148) || c >= 0x179));
+        }
+        if (c < 0x250) {
+            if (c >= 0x1CD && c <= 0x1DC) {
+                return alternating(c, false);
+            }
+            if ((c >= 0x1DE && c <= 0x1EF) || (c >= 0x1F8 && c <= 0x21F)
+                || (c >= 0x222 && c <= 0x233) || c >= 0x246) {
+                return alternating(c, true);
+            }
+            const Case* end = LATIN_EXTENDED_B + sizeof(LATIN_EXTENDED_B) / sizeof(Case);
+            const Case* found = std::lower_bound(
+                LATIN_EXTENDED_B, end, c,
+                [](const Case& pair, uint32_t value) { return pair.upper < value; });
+            return found != end && found->upper == c ? found->lower : c;
+        }
+        if (c >= 0x386 && c <= 0x3AB) {
+            if (c >= 0x391 && c != 0x3A2) {
+                return c + 0x20;
+            }
+            switch (c) {
+            case 0x386: return 0x3AC;
+            case 0x388: case 0x389: case 0x38A: return c + 0x25;
+            case 0x38C: return 0x3CC;
+            case 0x38E: case 0x38F: return c + 0x3F;
+            }
+            return c;
+        }
+        if (c == 0x3C2) {
+            return 0x3C3;
+        }
+        if (c >= 0x400 && c <= 0x52F) {
+            if (c < 0x410) {
+                return c + 0x50;
+            }
+            if (c < 0x430) {
+                return c + 0x20;
+            }
+            if (c == 0x4C0) {
+                return 0x4CF;
+            }
+            if ((c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF) || c >= 0x4D0) {
+                return alternating(c, true);
+            }
+            if (c >= 0x4C1 && c <= 0x4CE) {
+                return alternating(c, false);
+            }
+            return c;
+        }
+        if (c >= 0x531 && c <= 0x556) {
+            return c + 0x30;
+        }
+        if ((c >= 0x1E00 && c <= 0x1E95) || (c >= 0x1EA0 && c <= 0x1EFF)) {
+            return alternating(c, true);
+        }
+        if (c == 0x1E9E) {
+            return 0xDF;
+        }
+        if (c >= 0xFF21 && c <= 0xFF3A) {
+            return c - 0xFF21 + 'a';
+        }
+        if (c >= 0xFF41 && c <= 0xFF5A) {
+            return c - 0xFF41 + 'a';
+        }
+        for (size_t i = 0; i < sizeof(ZEROS) / sizeof(ZEROS[0]) && ZEROS[i] <= c; ++i) {
+            if (c - ZEROS[i] < 10) {
+                return '0' + (c - ZEROS[i]);
+            }
+        }
+        return c;
+    }
+
+    /**
+     * Append c to buffer as UTF-8, or if it's a byte decode couldn't read,
+     * that byte.
+     */
+    inline void append(std::string& buffer, uint32_t c)
+    {
+        if (c < 0x80) {
+            buffer.push_back(static_cast<char>(c));
+        } else if (c < 0x800) {
+            buffer.push_back(static_cast<char>(0xC0 | (c >> 6)));
+            buffer.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000) {
+            buffer.push_back(static_cast<char>(0xE0 | (c >> 12)));
+            buffer.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            buffer.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        } else if (c < 0x110000) {
+            buffer.push_back(static_cast<char>(0xF0 | (c >> 18)));
+            buffer.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+            buffer.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            buffer.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        } else {
+            buffer.push_back(static_cast<char>(c & 0xFF));
+        }
+    }
+
+    /**
+     * Append the hash of the token in buffer to tokens, if there is one, and
+     * start the next.
+     */
+    inline void end_token(std::string& buffer, std::vector<hash_t>& tokens)
+    {
+        if (!buffer.empty()) {
+            tokens.push_back(Simhash::hash_bytes(buffer.data(), buffer.size()));
+            buffer.clear();
+        }
+    }
+
+    /**
+     * The hash of a shingle of window tokens, from their polynomial.
+     */
+    inline hash_t finish(hash_t polynomial, size_t window)
+    {
+        return Simhash::Hash::mix(polynomial ^ Simhash::Hash::SECRET2,
+                                  Simhash::Hash::SECRET3 + window);
+    }
+
+    inline bool is_space(unsigned char c)
+    {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    inline bool is_continuation(const unsigned char* p, const unsigned char* end, size_t count)
+    {
+        if (static_cast<size_t>(end - p) < count) {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if ((p[i] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Whether a lead byte and the continuation byte after it start the
+     * shortest encoding of a code point that isn't a surrogate. Only the
+     * second byte ever needs checking for that.
+     */
+    inline bool is_shortest(unsigned char lead, unsigned char next)
+    {
+        switch (lead) {
+        case 0xE0: return next >= 0xA0;
+        case 0xED: return next < 0xA0;
+        case 0xF0: return next >= 0x90;
+        case 0xF4: return next < 0x90;
+        }
+        return lead >= 0xC2;
+    }
+
+    /**
+     * The code point of the UTF-8 character at p, advancing p past it. A byte
+     * that doesn't start a whole character in its shortest form, or starts a
+     * surrogate or something beyond U+10FFFF, is read alone, as a value above
+     * every code point.
+     */
+    inline uint32_t decode(const unsigned char*& p, const unsigned char* end)
+    {
+        unsigned char c = *p;
+        size_t following = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+        if (c < 0x80 || following == 0 || c > 0xF4 || !is_continuation(p + 1, end, following)
+            || !is_shortest(c, p[1])) {
+            ++p;
+            return c < 0x80 ? c : 0x110000 | c;
+        }
+        uint32_t result = c & (0x3F >> following);
+        for (size_t i = 1; i <= following; ++i) {
+            result = (result << 6) | (p[i] & 0x3F);
+        }
+        p += following + 1;
+        return result;
+    }
+
+    /**
+     * The next character of the text at p as char_ngrams reads it, advancing
+     * p past it. The text must not end in whitespace.
+     */
+    inline uint32_t next_char(const unsigned char*& p, const unsigned char* end)
+    {
+        unsigned char c = *p;
+        if (c > ' ' && c < 0x80) {
+            ++p;
+            return c + ((static_cast<unsigned char>(c - 'A') < 26) << 5);
+        }
+        if (is_space(c)) {
+            do {
+                ++p;
+            } while (is_space(*p));
+            return ' ';
+        }
+        return decode(p, end);
+    }
+
+    /**
+     * Call each with the hash of every n-gram of the text, as char_ngrams
+     * describes.
+     */
+    template <typename Each>
+    void for_char_ngrams(const char* text, size_t size, size_t n, Each each)
+    {
+        if (n == 0) {
+            throw std::invalid_argument("N-gram size must be positive");
+        }
+        const unsigned char* begin = reinterpret_cast<const unsigned char*>(text);
+        const unsigned char* end = begin + size;
+        while (begin < end && is_space(*begin)) {
+            ++begin;
+        }
+        while (end > begin && is_space(end[-1])) {
+            --end;
+        }
+        hash_t power = 1;
+        for (size_t i = 0; i < n; ++i) {
+            power *= BASE;
+        }
+
+        hash_t polynomial = 0;
+        size_t chars = 0;
+        const unsigned char* oldest = begin;
+        for (const unsigned char* p = begin; p < end; ) {
+            polynomial = polynomial * BASE + next_char(p, end);
+            if (++chars > n) {
+                polynomial -= next_char(oldest, end) * power;
+            }
+            if (chars >= n) {
+                each(finish(polynomial, n));
+            }
+        }
+        if (chars > 0 && chars < n) {
+            each(finish(polynomial, chars));
+        }
+    }
+}
+
+Simhash::Tokenizer::Tokenizer(bool mask_numbers)
+    : mask_numbers_(mask_numbers)
+    , buffer_()
+{
+}
+
+void Simhash::Tokenizer::tokenize(const char* text,
+                                  size_t size,
+                                  std::vector<Simhash::hash_t>& tokens)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+    const unsigned char* end = p + size;
+    buffer_.clear();
+    while (p < end) {
+        unsigned char c = *p;
+        if (c < 0x80) {
+            ++p;
+            if (c >= '0' && c <= '9') {
+                buffer_.push_back(mask_numbers_ ? '0' : static_cast<char>(c));
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+                buffer_.push_back(static_cast<char>(c | 0x20));
+            } else {
+                end_token(buffer_, tokens);
+            }
+            continue;
+        }
+
+        uint32_t point = decode(p, end);
+        if (in_ranges(SEPARATORS, point)) {
+            end_token(buffer_, tokens);
+        } else if (in_ranges(IDEOGRAPHS, point)) {
+            end_token(buffer_, tokens);
+            append(buffer_, point);
+            end_token(buffer_, tokens);
+        } else {
+            point = fold(point);
+            append(buffer_, (mask_numbers_ && point >= '0' && point <= '9') ? '0' : point);
+        }
+    }
+    end_token(buffer_, tokens);
+}
+
+void Simhash::shingle(const Simhash::hash_t* tokens,
+                      size_t count,
+                      size_t window,
+                      std::vector<Simhash::hash_t>& shingles)
+{
+    if (window == 0) {
+        throw std::invalid_argument("Window size must be positive");
+    }
+    window = std::min(window, count);
+    hash_t power = 1;
+    for (size_t i = 0; i < window; ++i) {
+        power *= BASE;
+    }
+
+    // Roll the window along: take in the next token and drop the oldest.
+    hash_t polynomial = 0;
+    for (size_t i = 0; i < count; ++i) {
+        polynomial = polynomial * BASE + tokens[i];
+        if (i >= window) {
+            polynomial -= tokens[i - window] * power;
+        }
+        if (i + 1 >= window) {
+            shingles.push_back(finish(polynomial, window));
+        }
+    }
+}
+
+void Simhash::shingle(const Simhash::hash_t* tokens,
+                      size_t count,
+                      const std::vector<size_t>& windows,
+                      std::vector<Simhash::hash_t>& shingles)
+{
+    std::vector<size_t> widths;
+    for (auto it = windows.begin(); it != windows.end(); ++it) {
+        if (*it == 0) {
+            throw std::invalid_argument("Window size must be positive");
+        }
+        widths.push_back(std::min(*it, count));
+    }
+    std::sort(widths.begin(), widths.end());
+    widths.erase(std::unique(widths.begin(), widths.end()), widths.end());
+    if (count == 0 || widths.empty()) {
+        return;
+    }
+
+    // powers[k] is BASE^widths[k], and prefixes holds the polynomial of the
+    // first i tokens at i % span, as far back as the widest window.
+    std::vector<hash_t> powers;
+    for (auto it = widths.begin(); it != widths.end(); ++it) {
+        hash_t power = 1;
+        for (size_t i = 0; i < *it; ++i) {
+            power *= BASE;
+        }
+        powers.push_back(power);
+    }
+    size_t span = widths.back() + 1;
+    std::vector<hash_t> prefixes(span, 0);
+
+    hash_t prefix = 0;
+    for (size_t end = 1; end <= count; ++end) {
+        prefix = prefix * BASE + tokens[end - 1];
+        prefixes[end % span] = prefix;
+        for (size_t k = 0; k < widths.size() && widths[k] <= end; ++k) {
+            hash_t polynomial = prefix - prefixes[(end - widths[k]) % span] * powers[k];
+            shingles.push_back(finish(polynomial, widths[k]));
+        }
+    }
+}
+
+void Simhash::char_ngrams(const char* text,
+                          size_t size,
+                          size_t n,
+                          std::vector<Simhash::hash_t>& ngrams)
+{
+    for_char_ngrams(text, size, n, [&](hash_t hash) {
+        ngrams.push_back(hash);
+    });
+}
+
+void Simhash::char_ngrams(const char* text,
+                          size_t size,
+                          size_t n,
+                          Simhash::Accumulator& accumulator)
+{
+    hash_t batch[NGRAM_BATCH];
+    size_t filled = 0;
+    for_char_ngrams(text, size, n, [&](hash_t hash) {
+        batch[filled++] = hash;
+        if (filled == NGRAM_BATCH) {
+            accumulator.add(batch, filled);
+            filled = 0;
+        }
+    });
+    accumulator.add(batch, filled);
+}
+
+Simhash::Fingerprinter::Fingerprinter(size_t window, bool mask_numbers)
+    : window_(window)
+    , tokenizer_(mask_numbers)
+    , tokens_()
+    , shingles_()
+{
+    if (window == 0) {
+        throw std::invalid_argument("Window size must be positive");
+    }
+}
+
+Simhash::hash_t Simhash::Fingerprinter::fingerprint(const char* text, size_t size)
+{
+    tokens_.clear();
+    shingles_.clear();
+    tokenizer_.tokenize(text, size, tokens_);
+    shingle(tokens_.data(), tokens_.size(), window_, shingles_);
+    return compute(shingles_.data(), shingles_.size());
+}
+
+void Simhash::fingerprint_many(const char* const* texts,
+                               const size_t* sizes,
+                               size_t count,
+                               size_t window,
+                               bool mask_numbers,
+                               Simhash::hash_t* results,
+                               Simhash::Pool& pool)
+{
+    Fingerprinter prototype(window, mask_numbers);
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bytes += sizes[i];
+    }
+    pool.split(count, bytes * NANOSECONDS_PER_BYTE, [&](size_t begin, size_t end) {
+        Fingerprinter fingerprinter(prototype);
+        for (size_t i = begin; i < end; ++i) {
+            results[i] = fingerprinter.fingerprint(texts[i], sizes[i]);
+        }
+    });
+}
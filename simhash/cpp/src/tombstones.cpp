@@ -0,0 +1,22 @@
+#include "tombstones.h"
+
+Simhash::Tombstones::Tombstones(size_t size)
+    : size_(size)
+    , words_(new std::atomic<uint64_t>[(size + 63) / 64])
+    , count_(0)
+{
+    for (size_t i = 0; i < (size + 63) / 64; ++i) {
+        words_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+bool Simhash::Tombstones::set(size_t position)
+{
+    uint64_t bit = static_cast<uint64_t>(1) << (position % 64);
+    uint64_t previous = words_[position / 64].fetch_or(bit, std::memory_order_relaxed);
+    if (previous & bit) {
+        return false;
+    }
+    count_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
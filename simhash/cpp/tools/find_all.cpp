@@ -0,0 +1,238 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "find.h"
+
+namespace {
+    void usage(const char* program)
+    {
+        std::fprintf(stderr,
+            "Usage: %s [options] INPUT OUTPUT\n"
+            "\n"
+            "Options:\n"
+            "  --blocks N     Number of blocks to divide hashes into, or 'auto' to\n"
+            "                 pick it from a sample of the input (default 6)\n"
+            "  --balanced     Size the blocks so that each carries about the same\n"
+            "                 entropy in a sample of the input, rather than evenly\n"
+            "  --bits N       Number of bits that may differ (default 3)\n"
+            "  --threads N    Number of threads, or 0 for one per core (default 0)\n"
+            "  --memory N     Memory budget in bytes (default 1073741824)\n"
+            "  --temp DIR     Directory to make a directory of sorted runs in\n"
+            "                 (default /tmp)\n"
+            "  --append       Add the matches to the end of OUTPUT, rather than\n"
+            "                 replacing what's in it\n",
+            program);
+    }
+
+    bool parse(const char* text, size_t& value)
+    {
+        char* end = nullptr;
+        errno = 0;
+        unsigned long long parsed = std::strtoull(text, &end, 10);
+        if (errno || end == text || *end != '\0') {
+            return false;
+        }
+        value = static_cast<size_t>(parsed);
+        return true;
+    }
+
+    /**
+     * Empty the file with the provided name, creating it if need be.
+     */
+    void empty(const std::string& name)
+    {
+        int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + name);
+        }
+        ::close(fd);
+    }
+
+    /**
+     * A read-only memory mapping of a whole file of hashes.
+     */
+    class Mapping {
+    public:
+        explicit Mapping(const std::string& name)
+            : data_(nullptr)
+            , bytes_(0)
+        {
+            int fd = ::open(name.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Could not open " + name);
+            }
+            struct stat info;
+            if (::fstat(fd, &info) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Could not read " + name);
+            }
+            bytes_ = static_cast<size_t>(info.st_size);
+            if (bytes_) {
+                data_ = ::mmap(nullptr, bytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            ::close(fd);
+            if (data_ == MAP_FAILED) {
+                throw std::runtime_error("Could not map " + name);
+            }
+            if (bytes_ % sizeof(Simhash::hash_t)) {
+                ::munmap(data_, bytes_);
+                throw std::runtime_error(name + " doesn't hold a whole number of hashes");
+            }
+        }
+
+        ~Mapping()
+        {
+            if (data_) {
+                ::munmap(data_, bytes_);
+            }
+        }
+
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        const Simhash::hash_t* hashes() const
+        {
+            return static_cast<const Simhash::hash_t*>(data_);
+        }
+
+        size_t size() const { return bytes_ / sizeof(Simhash::hash_t); }
+
+    private:
+        void* data_;
+        size_t bytes_;
+    };
+}
+
+/**
+ * Find all the matches among the fingerprints in a file of raw 64-bit hashes
+ * in native (on every supported platform, little-endian) byte order, and
+ * write them to an output file as 17-byte records of the smaller hash, the
+ * larger hash and the number of bits they differ by. Prints the number of
+ * matches. The output file is replaced unless --append is passed.
+ *
+ * The input is memory-mapped and searched in memory if that fits within the
+ * memory budget, and otherwise sorted into runs on disk and merged.
+ */
+int main(int argc, char* argv[])
+{
+    // Zero blocks means they're picked once the input is mapped.
+    size_t blocks = 6;
+    bool balanced = false;
+    bool append = false;
+    size_t bits = 3;
+    size_t threads = 0;
+    size_t memory = size_t(1) << 30;
+    std::string temp = "/tmp";
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (arg.compare(0, 2, "--") != 0) {
+            paths.push_back(arg);
+            continue;
+        }
+        if (arg == "--balanced") {
+            balanced = true;
+            continue;
+        }
+        if (arg == "--append") {
+            append = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        const char* value = argv[++i];
+        bool valid = true;
+        if (arg == "--blocks") {
+            if (std::string(value) == "auto") {
+                blocks = 0;
+            } else {
+                valid = parse(value, blocks) && blocks;
+            }
+        } else if (arg == "--bits") {
+            valid = parse(value, bits);
+        } else if (arg == "--threads") {
+            valid = parse(value, threads);
+        } else if (arg == "--memory") {
+            valid = parse(value, memory);
+        } else if (arg == "--temp") {
+            temp = value;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (paths.size() != 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    try {
+        Simhash::Pool pool(threads);
+        size_t count;
+        {
+            // Searching in memory takes a sorted copy of the hashes, and
+            // another for every thread.
+            Mapping input(paths[0]);
+            if (!blocks) {
+                blocks = Simhash::choose_blocks(input.hashes(), input.size(), bits);
+            }
+            std::vector<Simhash::Permutation> permutations = balanced
+                ? Simhash::permutations_of(
+                      Simhash::balanced_blocks(input.hashes(), input.size(), blocks), bits)
+                : Simhash::Permutation::choose(blocks, bits);
+            size_t needed = input.size() * sizeof(Simhash::hash_t) * (pool.threads() + 1);
+            if (needed <= memory) {
+                Simhash::Matches matches = Simhash::find_matches(
+                    input.hashes(), input.size(), permutations, bits, pool);
+                if (!append) {
+                    empty(paths[1]);
+                }
+                Simhash::append_matches(paths[1], matches);
+                count = matches.size();
+            } else {
+                std::string runs = temp + "/simhash-XXXXXX";
+                if (!::mkdtemp(&runs[0])) {
+                    throw std::runtime_error("Could not make a directory in " + temp);
+                }
+                try {
+                    if (!append) {
+                        empty(paths[1]);
+                    }
+                    count = Simhash::find_matches_external(
+                        paths[0], paths[1], permutations, bits, memory, runs, pool);
+                } catch (...) {
+                    ::rmdir(runs.c_str());
+                    throw;
+                }
+                ::rmdir(runs.c_str());
+            }
+        }
+        std::printf("%zu\n", count);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -2,11 +2,16 @@
 # Cython declarations
 ################################################################################
 
+from libcpp cimport bool
+from libcpp.map cimport map
+from libcpp.memory cimport shared_ptr, make_shared
+from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp.utility cimport pair
 from libcpp.unordered_set cimport unordered_set
 
 cdef extern from "stdint.h":
+    ctypedef unsigned char      uint8_t
     ctypedef unsigned long long uint64_t
     ctypedef          long long  int64_t
     ctypedef unsigned int       size_t
@@ -25,3 +30,201 @@ cdef extern from "simhash-cpp/include/simhash.h" namespace "Simhash":
     matches_t find_all(unordered_set[hash_t] hashes,
                        size_t number_of_blocks,
                        size_t different_bits)
+
+cdef extern from "simhash-cpp/include/permutation.h" namespace "Simhash":
+    cppclass Permutation:
+        @staticmethod
+        vector[Permutation] choose(size_t number_of_blocks,
+                                   size_t different_bits) except +
+
+cdef extern from "cpp/include/hash.h" namespace "Simhash":
+    hash_t hash_bytes(const void* data, size_t size, uint64_t seed) nogil
+
+cdef extern from "cpp/include/pool.h" namespace "Simhash":
+    cppclass c_Pool "Simhash::Pool":
+        c_Pool(size_t threads) except +
+
+cdef extern from "cpp/include/stoplist.h" namespace "Simhash":
+    cppclass c_Stoplist "Simhash::Stoplist":
+        c_Stoplist()
+        c_Stoplist(const hash_t* hashes, size_t count) except +
+        bool contains(hash_t hash) nogil
+        size_t filter(const hash_t* hashes, size_t count, hash_t* kept) nogil
+        void save(const string& path) except + nogil
+        void load(const string& path) except + nogil
+        size_t size()
+
+cdef extern from "cpp/include/compute.h" namespace "Simhash":
+    hash_t c_compute "Simhash::compute"(const hash_t* hashes, size_t count) nogil
+    hash_t c_compute_filtered "Simhash::compute"(
+        const hash_t* hashes,
+        size_t count,
+        const c_Stoplist& stoplist) nogil
+    void c_compute_many "Simhash::compute_many"(
+        const hash_t* hashes,
+        size_t count,
+        const uint64_t* offsets,
+        size_t documents,
+        hash_t* results,
+        c_Pool& pool) except + nogil
+    void c_compute_many_filtered "Simhash::compute_many"(
+        const hash_t* hashes,
+        size_t count,
+        const uint64_t* offsets,
+        size_t documents,
+        const c_Stoplist& stoplist,
+        hash_t* results,
+        c_Pool& pool) except + nogil
+    hash_t c_compute_weighted "Simhash::compute_weighted"(
+        const hash_t* hashes,
+        const double* weights,
+        size_t count) nogil
+    void c_compute_weighted_many "Simhash::compute_weighted_many"(
+        const hash_t* hashes,
+        const double* weights,
+        size_t count,
+        const uint64_t* offsets,
+        size_t documents,
+        hash_t* results,
+        c_Pool& pool) except + nogil
+
+    cppclass c_Accumulator "Simhash::Accumulator":
+        c_Accumulator()
+        void add(hash_t hash, int64_t weight)
+        void add(const hash_t* hashes, size_t count) nogil
+        void remove(hash_t hash, int64_t weight)
+        void remove(const hash_t* hashes, size_t count) nogil
+        void merge(const c_Accumulator& other)
+        hash_t digest()
+
+cdef extern from "cpp/include/text.h" namespace "Simhash":
+    cppclass c_Tokenizer "Simhash::Tokenizer":
+        c_Tokenizer(bool mask_numbers)
+        void tokenize(const char* text, size_t size, vector[hash_t]& tokens) nogil
+
+    void c_shingle "Simhash::shingle"(
+        const hash_t* tokens,
+        size_t count,
+        const vector[size_t]& windows,
+        vector[hash_t]& shingles) except + nogil
+
+    void c_char_ngrams "Simhash::char_ngrams"(
+        const char* text,
+        size_t size,
+        size_t n,
+        vector[hash_t]& ngrams) except + nogil
+
+    void c_add_char_ngrams "Simhash::char_ngrams"(
+        const char* text,
+        size_t size,
+        size_t n,
+        c_Accumulator& accumulator) except + nogil
+
+    cppclass c_Fingerprinter "Simhash::Fingerprinter":
+        c_Fingerprinter(size_t window, bool mask_numbers) except +
+        hash_t fingerprint(const char* text, size_t size) nogil
+
+    void c_fingerprint_many "Simhash::fingerprint_many"(
+        const char* const* texts,
+        const size_t* sizes,
+        size_t count,
+        size_t window,
+        bool mask_numbers,
+        hash_t* results,
+        c_Pool& pool) except + nogil
+
+cdef extern from "cpp/include/blocks.h" namespace "Simhash":
+    size_t c_choose_blocks "Simhash::choose_blocks"(
+        const vector[hash_t]& hashes,
+        size_t different_bits) except + nogil
+    size_t c_choose_blocks "Simhash::choose_blocks"(
+        const hash_t* hashes,
+        size_t count,
+        size_t different_bits) except + nogil
+    vector[hash_t] c_balanced_blocks "Simhash::balanced_blocks"(
+        const vector[hash_t]& hashes,
+        size_t number_of_blocks) except + nogil
+    vector[Permutation] permutations_of(vector[hash_t] blocks,
+                                        size_t different_bits) except +
+
+cdef extern from "cpp/include/schedule.h" namespace "Simhash":
+    vector[double] c_recall "Simhash::recall"(
+        const vector[Permutation]& permutations,
+        size_t different_bits) except +
+    vector[size_t] choose_tables(const vector[Permutation]& permutations,
+                                 size_t different_bits,
+                                 size_t count) except +
+
+cdef extern from "cpp/include/ball.h" namespace "Simhash":
+    bool c_ball_beats_search "Simhash::ball_beats_search"(
+        size_t count,
+        size_t different_bits,
+        size_t tables)
+    bool c_ball_beats_sort "Simhash::ball_beats_sort"(
+        size_t count,
+        size_t different_bits,
+        size_t tables)
+
+cdef extern from "cpp/include/find.h" namespace "Simhash":
+    cppclass Matches:
+        vector[hash_t] first
+        vector[hash_t] second
+        vector[uint8_t] distance
+        size_t size()
+
+    Matches find_matches(const vector[hash_t]& hashes,
+                         const vector[Permutation]& permutations,
+                         size_t different_bits,
+                         c_Pool& pool) except + nogil
+
+    size_t find_matches_external(const string& input,
+                                 const string& output,
+                                 const vector[Permutation]& permutations,
+                                 size_t different_bits,
+                                 size_t memory,
+                                 const string& directory,
+                                 c_Pool& pool) except + nogil
+
+    cppclass c_Tables "Simhash::Tables":
+        c_Tables(const vector[hash_t]& hashes,
+                 const vector[Permutation]& permutations,
+                 size_t different_bits,
+                 c_Pool& pool) except + nogil
+        Matches find(const vector[hash_t]& queries, c_Pool& pool) except + nogil
+        Matches add(const vector[hash_t]& hashes, c_Pool& pool) except + nogil
+        void save(const string& prefix, c_Pool& pool) except + nogil
+        void load(const string& prefix, c_Pool& pool) except + nogil
+        size_t size()
+        size_t different_bits()
+
+    Matches c_find_between "Simhash::find_between"(
+        const vector[hash_t]& queries,
+        const vector[hash_t]& corpus,
+        const vector[Permutation]& permutations,
+        size_t different_bits,
+        c_Pool& pool) except + nogil
+
+cdef extern from "cpp/include/memtable.h" namespace "Simhash":
+    ctypedef uint64_t doc_id_t
+    ctypedef pair[hash_t, doc_id_t] entry_t
+    ctypedef pair[size_t, entry_t] neighbor_t
+
+cdef extern from "cpp/include/index.h" namespace "Simhash":
+    cppclass c_Index "Simhash::Index":
+        c_Index(const vector[Permutation]& permutations,
+                size_t different_bits,
+                size_t memtable_capacity,
+                size_t merge_factor,
+                size_t threads) except +
+        void insert(hash_t hash, doc_id_t id) except + nogil
+        size_t remove(hash_t hash, doc_id_t id) nogil
+        vector[entry_t] find(hash_t query) except + nogil
+        vector[neighbor_t] nearest(hash_t query,
+                                   size_t k,
+                                   size_t max_distance) except + nogil
+        void flush() except + nogil
+        void compact() except + nogil
+        void save(const string& directory) except + nogil
+        void load(const string& directory) except + nogil
+        size_t size() nogil
+        size_t segments() nogil
@@ -1,10 +1,20 @@
 import hashlib
+import mmap
+import os
+import shutil
 import struct
+import tempfile
+from array import array
 
-from simhash cimport compute as c_compute
-from simhash cimport find_all as c_find_all
+from libc.string cimport memcpy
 
 
+cdef string encode_path(path):
+    '''Returns a filesystem path as bytes.'''
+    if isinstance(path, bytes):
+        return path
+    return path.encode('utf8')
+
 def unsigned_hash(bytes obj):
     '''Returns a hash suitable for use as a hash_t.'''
     # Takes first 8 bytes of MD5 digest
@@ -12,18 +22,770 @@ def unsigned_hash(bytes obj):
     # Unpacks the binary bytes in digest into a Python integer
     return struct.unpack('>Q', digest)[0] & 0xFFFFFFFFFFFFFFFF
 
-def compute(hashes):
-    '''Compute the simhash of a vector of hashes.'''
-    return c_compute(hashes)
+def fast_hash(bytes obj, uint64_t seed=0):
+    '''
+    Returns a 64-bit hash of obj suitable for use as a hash_t, several times
+    faster than unsigned_hash but not compatible with it. Different seeds
+    give unrelated hashes.
+    '''
+    return hash_bytes(<const char*>obj, len(obj), seed)
+
+def fast_hash_many(objs, uint64_t seed=0):
+    '''Returns the fast_hash of each of a sequence of bytes, as an array('Q').'''
+    results = array('Q', bytes(8 * len(objs)))
+    cdef hash_t[::1] c_results = results
+    cdef bytes obj
+    cdef size_t i
+    for i, obj in enumerate(objs):
+        c_results[i] = hash_bytes(<const char*>obj, len(obj), seed)
+    return results
+
+cdef class Stoplist:
+    '''
+    A set of feature hashes to leave out of simhashes, such as those of
+    stopwords, or of the shingles of a site's navigation and footers that
+    would otherwise make all of its pages look alike. It can be passed to
+    compute and compute_many.
+
+    The hashes are kept in a compact open-addressing table, which can be
+    saved to a file and loaded back by mapping it into memory, so that a
+    large stoplist loads instantly and is shared between processes.
+    '''
+    # Loading swaps in a new table rather than changing this one, and
+    # anything using the table without the GIL holds its own reference, so
+    # a table is only unmapped once nothing is reading it.
+    cdef shared_ptr[c_Stoplist] stoplist
+
+    def __cinit__(self, hashes=()):
+        cdef const hash_t[::1] c_hashes = words(hashes)
+        cdef const hash_t* first = &c_hashes[0] if c_hashes.shape[0] else NULL
+        self.stoplist.reset(new c_Stoplist(first, c_hashes.shape[0]))
+
+    def filter(self, hashes):
+        '''The hashes that aren't in this stoplist, in order, as an array('Q').'''
+        cdef const hash_t[::1] c_hashes = words(hashes)
+        results = array('Q', bytes(8 * c_hashes.shape[0]))
+        if not results:
+            return results
+        cdef hash_t[::1] c_results = results
+        cdef size_t kept
+        cdef shared_ptr[c_Stoplist] table = self.stoplist
+        with nogil:
+            kept = table.get().filter(
+                &c_hashes[0], c_hashes.shape[0], &c_results[0])
+        return results[:kept]
+
+    def save(self, path):
+        '''Save the table to a file, in native byte order.'''
+        cdef string c_path = encode_path(path)
+        cdef shared_ptr[c_Stoplist] table = self.stoplist
+        with nogil:
+            table.get().save(c_path)
+
+    def load(self, path):
+        '''Replace this stoplist with the one saved at path, mapped into memory.'''
+        cdef string c_path = encode_path(path)
+        cdef shared_ptr[c_Stoplist] loaded = make_shared[c_Stoplist]()
+        with nogil:
+            loaded.get().load(c_path)
+        self.stoplist = loaded
+
+    def __contains__(self, hash_t hash):
+        return self.stoplist.get().contains(hash)
+
+    def __len__(self):
+        return self.stoplist.get().size()
+
+def compute(hashes, Stoplist stoplist=None):
+    '''
+    Compute the simhash of a vector of hashes, leaving out any that are in
+    the stoplist.
+    '''
+    cdef vector[hash_t] c_hashes = hashes
+    cdef hash_t result
+    cdef shared_ptr[c_Stoplist] table
+    if stoplist is not None:
+        table = stoplist.stoplist
+        with nogil:
+            result = c_compute_filtered(
+                c_hashes.data(), c_hashes.size(), table.get()[0])
+        return result
+    with nogil:
+        result = c_compute(c_hashes.data(), c_hashes.size())
+    return result
+
+cdef const hash_t[::1] words(values) except *:
+    '''Returns values as 64-bit words, copying them only if they aren't.'''
+    try:
+        return values
+    except (TypeError, ValueError):
+        return array('Q', values)
+
+cdef object to_array(const vector[hash_t]& values):
+    '''Returns a copy of values as an array('Q').'''
+    results = array('Q', bytes(8 * values.size()))
+    cdef hash_t[::1] c_results = results
+    if values.size():
+        memcpy(&c_results[0], values.data(), 8 * values.size())
+    return results
+
+cdef bytes utf8(text):
+    '''Returns text as UTF-8 bytes, encoding it if it isn't already.'''
+    if isinstance(text, bytes):
+        return text
+    return text.encode('utf8')
+
+cdef map[size_t, c_Pool*] shared_pools
+
+cdef c_Pool* shared_pool(size_t threads) except NULL:
+    '''
+    Returns the pool of this many threads, or of one per core if it's 0, that
+    the batch functions share. Each is made the first time it's asked for and
+    kept, since starting threads costs more than computing a small batch.
+    Pools serialize their callers, so Python threads can share them.
+    '''
+    if not shared_pools.count(threads):
+        shared_pools[threads] = new c_Pool(threads)
+    return shared_pools[threads]
+
+cdef const double[::1] reals(values) except *:
+    '''Returns values as doubles, copying them only if they aren't.'''
+    try:
+        return values
+    except (TypeError, ValueError):
+        return array('d', values)
+
+def compute_weighted(hashes, weights):
+    '''
+    Compute the simhash of a vector of hashes with these weights, such as
+    term frequencies or IDFs. Each bit is set if the hashes that have it
+    outweigh those that don't, so with every weight 1 this is compute.
+    '''
+    cdef vector[hash_t] c_hashes = hashes
+    cdef vector[double] c_weights = weights
+    if c_hashes.size() != c_weights.size():
+        raise ValueError('There must be one weight for every hash')
+    cdef hash_t result
+    with nogil:
+        result = c_compute_weighted(
+            c_hashes.data(), c_weights.data(), c_hashes.size())
+    return result
+
+def compute_many(hashes, offsets, threads=1, Stoplist stoplist=None):
+    '''
+    Compute the simhash of each of many documents at once, as an array('Q').
+
+    The documents' hashes are stored one after another, with document i's in
+    hashes[offsets[i]:offsets[i + 1]], so there is one more offset than there
+    are documents. Both may be any buffer of unsigned 64-bit integers, such as
+    an array('Q') or a numpy uint64 array, or else a sequence of them. The
+    documents are split among `threads` threads, or one per core if it's 0,
+    unless there are too few hashes for that to pay off. Hashes in the
+    stoplist are left out of every document as it's computed.
+    '''
+    cdef const hash_t[::1] c_hashes = words(hashes)
+    cdef const uint64_t[::1] c_offsets = words(offsets)
+    if c_offsets.shape[0] == 0:
+        raise ValueError('There must be at least one offset')
+    cdef size_t documents = c_offsets.shape[0] - 1
+    results = array('Q', bytes(8 * documents))
+    if documents == 0:
+        return results
+    cdef hash_t[::1] c_results = results
+    cdef const hash_t* first = &c_hashes[0] if c_hashes.shape[0] else NULL
+    cdef c_Pool* pool = shared_pool(threads)
+    cdef shared_ptr[c_Stoplist] table
+    if stoplist is not None:
+        table = stoplist.stoplist
+        with nogil:
+            c_compute_many_filtered(
+                first, c_hashes.shape[0], &c_offsets[0], documents,
+                table.get()[0], &c_results[0], pool[0])
+    else:
+        with nogil:
+            c_compute_many(first, c_hashes.shape[0], &c_offsets[0],
+                           documents, &c_results[0], pool[0])
+    return results
+
+def compute_weighted_many(hashes, weights, offsets, threads=1):
+    '''
+    Compute the weighted simhash of each of many documents at once, as
+    compute_many does, with document i's weights in
+    weights[offsets[i]:offsets[i + 1]]. The weights may be any buffer of
+    doubles, such as an array('d') or a numpy float64 array, or else a
+    sequence of numbers.
+    '''
+    cdef const hash_t[::1] c_hashes = words(hashes)
+    cdef const double[::1] c_weights = reals(weights)
+    cdef const uint64_t[::1] c_offsets = words(offsets)
+    if c_weights.shape[0] != c_hashes.shape[0]:
+        raise ValueError('There must be one weight for every hash')
+    if c_offsets.shape[0] == 0:
+        raise ValueError('There must be at least one offset')
+    cdef size_t documents = c_offsets.shape[0] - 1
+    results = array('Q', bytes(8 * documents))
+    if documents == 0:
+        return results
+    cdef hash_t[::1] c_results = results
+    cdef const hash_t* first = &c_hashes[0] if c_hashes.shape[0] else NULL
+    cdef const double* first_weight = &c_weights[0] if c_weights.shape[0] else NULL
+    cdef c_Pool* pool = shared_pool(threads)
+    with nogil:
+        c_compute_weighted_many(
+            first, first_weight, c_hashes.shape[0], &c_offsets[0],
+            documents, &c_results[0], pool[0])
+    return results
+
+cdef class Accumulator:
+    '''
+    The running sums behind a simhash, so that it can be kept up to date as
+    features are added and removed, as over a sliding window, rather than
+    computed again from all of them each time.
+
+    digest() returns the compute of the hashes added and not since removed,
+    or their compute_weighted if they were added with integer weights. Two
+    accumulators can be combined with merge.
+    '''
+    cdef c_Accumulator* accumulator
+
+    def __cinit__(self):
+        self.accumulator = new c_Accumulator()
+
+    def __dealloc__(self):
+        del self.accumulator
+
+    def add(self, hash_t hash, int64_t weight=1):
+        '''Add one feature hash, with an integer weight.'''
+        self.accumulator.add(hash, weight)
+
+    def remove(self, hash_t hash, int64_t weight=1):
+        '''Remove one feature hash that was added with this weight.'''
+        self.accumulator.remove(hash, weight)
+
+    def add_all(self, hashes):
+        '''Add many feature hashes at once, each with a weight of 1.'''
+        cdef vector[hash_t] c_hashes = hashes
+        with nogil:
+            self.accumulator.add(c_hashes.data(), c_hashes.size())
+
+    def remove_all(self, hashes):
+        '''Remove many feature hashes at once, each with a weight of 1.'''
+        cdef vector[hash_t] c_hashes = hashes
+        with nogil:
+            self.accumulator.remove(c_hashes.data(), c_hashes.size())
+
+    def add_ngrams(self, text, n=3):
+        '''
+        Add the hashes of the character n-grams of a text, as char_ngrams
+        makes them, without making a list of them first.
+        '''
+        cdef bytes data = utf8(text)
+        cdef const char* c_text = data
+        cdef size_t size = len(data)
+        cdef size_t c_n = n
+        with nogil:
+            c_add_char_ngrams(c_text, size, c_n, self.accumulator[0])
+
+    def merge(self, Accumulator other):
+        '''Add all of the features of other to this.'''
+        self.accumulator.merge(other.accumulator[0])
+
+    def digest(self):
+        '''The simhash of the features added so far.'''
+        return self.accumulator.digest()
+
+def shingle_hashes(hashes, window=4):
+    '''
+    The hash of each shingle of `window` consecutive token hashes, as an
+    array('Q') ready for compute, or if there are fewer hashes than that, the
+    hash of them all. The window may also be a list of sizes, to hash the
+    shingles of each size in one pass, in no particular order. Each shingle
+    costs the same to hash however wide it is, and these are the shingles
+    that fingerprint hashes for tokens hashed with fast_hash.
+
+    The hashes may be any buffer of unsigned 64-bit integers, or else a
+    sequence of them.
+    '''
+    cdef const hash_t[::1] c_hashes = words(hashes)
+    cdef vector[size_t] windows
+    if isinstance(window, (list, tuple)):
+        windows = window
+    else:
+        windows.push_back(window)
+    cdef const hash_t* first = &c_hashes[0] if c_hashes.shape[0] else NULL
+    cdef vector[hash_t] shingles
+    with nogil:
+        c_shingle(first, c_hashes.shape[0], windows, shingles)
+    return to_array(shingles)
+
+def char_ngrams(text, n=3):
+    '''
+    The hash of each run of `n` consecutive characters of a text, as UTF-8
+    bytes or a string, as an array('Q') ready for compute, or if it has fewer
+    characters than that, the hash of them all. This suits short texts, and
+    scripts such as Chinese and Japanese that don't put spaces between words.
+
+    ASCII letters are lowercased and each run of whitespace counts as a single
+    space, ignoring any at either end. The hashes are rolled along the text in
+    one native pass, so each n-gram costs the same however long it is.
+    '''
+    cdef bytes data = utf8(text)
+    cdef const char* c_text = data
+    cdef size_t size = len(data)
+    cdef size_t c_n = n
+    cdef vector[hash_t] ngrams
+    with nogil:
+        c_char_ngrams(c_text, size, c_n, ngrams)
+    return to_array(ngrams)
+
+def tokenize(text, mask_numbers=False):
+    '''
+    The hashes of the tokens of a text, as UTF-8 bytes or a string, as an
+    array('Q') ready for shingle_hashes.
+
+    A token is a run of letters and digits of any script, case folded, and
+    each Chinese or Japanese ideograph is a token of its own. Whitespace,
+    punctuation and symbols only separate tokens. Fullwidth characters and
+    the digits of other scripts are read as ASCII, and with mask_numbers,
+    every digit is read as 0. Each token is hashed with fast_hash of its
+    normalized UTF-8.
+    '''
+    cdef bytes data = utf8(text)
+    cdef const char* c_text = data
+    cdef size_t size = len(data)
+    cdef c_Tokenizer* tokenizer = new c_Tokenizer(mask_numbers)
+    cdef vector[hash_t] tokens
+    try:
+        with nogil:
+            tokenizer.tokenize(c_text, size, tokens)
+    finally:
+        del tokenizer
+    return to_array(tokens)
+
+def fingerprint(text, window=4, mask_numbers=False):
+    '''
+    Compute the simhash of a document's text, as UTF-8 bytes or a string, in
+    one native pass. The text is split into tokens as tokenize splits it, and
+    each shingle of `window` tokens is hashed in turn and fed to compute,
+    without any Python objects along the way. A text with fewer tokens than
+    that has a single shingle of them all.
+    '''
+    cdef bytes data = utf8(text)
+    cdef const char* c_text = data
+    cdef size_t size = len(data)
+    cdef c_Fingerprinter* fingerprinter = new c_Fingerprinter(
+        window, mask_numbers)
+    cdef hash_t result
+    try:
+        with nogil:
+            result = fingerprinter.fingerprint(c_text, size)
+    finally:
+        del fingerprinter
+    return result
+
+def fingerprint_many(texts, window=4, threads=1, mask_numbers=False):
+    '''
+    The fingerprint of each of a sequence of texts, as fingerprint computes
+    it, as an array('Q'), split among `threads` threads, or one per core if
+    it's 0, unless there's too little text for that to pay off.
+    '''
+    documents = [utf8(text) for text in texts]
+    cdef size_t c_window = window
+    cdef bool c_mask_numbers = mask_numbers
+    cdef vector[const char*] c_texts
+    cdef vector[size_t] c_sizes
+    cdef bytes document
+    for document in documents:
+        c_texts.push_back(document)
+        c_sizes.push_back(len(document))
+    results = array('Q', bytes(8 * len(documents)))
+    if not documents:
+        return results
+    cdef hash_t[::1] c_results = results
+    cdef c_Pool* pool = shared_pool(threads)
+    with nogil:
+        c_fingerprint_many(
+            c_texts.data(), c_sizes.data(), c_texts.size(), c_window,
+            c_mask_numbers, &c_results[0], pool[0])
+    return results
+
+def choose_blocks(hashes, different_bits):
+    '''
+    Pick the number of blocks that should make find_all fastest on these
+    hashes, for matches within different_bits. This estimates, from a sample,
+    how many candidate pairs each number of blocks would compare against the
+    cost of sorting its extra tables.
+    '''
+    cdef vector[hash_t] c_hashes = hashes
+    cdef size_t bits = different_bits
+    cdef size_t blocks
+    with nogil:
+        blocks = c_choose_blocks(c_hashes, bits)
+    return blocks
 
-def find_all(hashes, number_of_blocks, different_bits):
+def balanced_blocks(hashes, number_of_blocks):
+    '''
+    Returns the masks of number_of_blocks contiguous blocks that each carry
+    about the same share of the information in these hashes, judging by the
+    entropy of each bit in a sample. These can be passed instead of a number
+    of blocks, and keep the buckets even when some bits are much more
+    predictable than others.
+    '''
+    cdef vector[hash_t] c_hashes = hashes
+    cdef size_t blocks = number_of_blocks
+    cdef vector[hash_t] masks
+    with nogil:
+        masks = c_balanced_blocks(c_hashes, blocks)
+    return masks
+
+cdef vector[Permutation] permutations(number_of_blocks,
+                                      const vector[hash_t]& hashes,
+                                      size_t different_bits) except *:
+    '''
+    Returns the permutations of number_of_blocks evenly sized blocks, or of a
+    list of block masks. If it's None, the number of blocks is picked for the
+    hashes.
+    '''
+    cdef size_t blocks
+    if isinstance(number_of_blocks, (list, tuple)):
+        return permutations_of(number_of_blocks, different_bits)
+    if number_of_blocks is None:
+        with nogil:
+            blocks = c_choose_blocks(hashes, different_bits)
+    else:
+        blocks = number_of_blocks
+    return Permutation.choose(blocks, different_bits)
+
+cdef vector[Permutation] subset(const vector[Permutation]& permutations,
+                                tables, size_t different_bits) except *:
+    '''
+    Returns the permutations at the indexes in tables, or if it's a number,
+    that many of them picked with choose_tables. All of them if it's None.
+    '''
+    cdef vector[size_t] indexes
+    cdef vector[Permutation] result
+    if tables is None:
+        return permutations
+    if isinstance(tables, (list, tuple)):
+        indexes = tables
+    else:
+        indexes = choose_tables(permutations, different_bits, tables)
+    for i in indexes:
+        if i >= permutations.size():
+            raise ValueError('There are only %d tables' % permutations.size())
+        result.push_back(permutations[i])
+    return result
+
+def recall(number_of_blocks, different_bits, tables=None):
+    '''
+    Returns the fraction of the pairs that differ by d bits that find_all
+    would find when it only searches `tables`, as a list for every d up to
+    different_bits. The differing bits are taken to fall anywhere with equal
+    likelihood, which holds for simhashes of unrelated changes.
+    '''
+    cdef vector[hash_t] empty
+    cdef size_t bits = different_bits
+    cdef vector[Permutation] c_permutations = subset(
+        permutations(number_of_blocks, empty, bits), tables, bits)
+    return c_recall(c_permutations, bits)
+
+def ball_beats_search(count, different_bits, tables):
+    '''
+    Returns whether an Index looks up each hash within different_bits of a
+    query in a segment of count hashes, rather than searching its tables,
+    when there are this many of them.
+    '''
+    return c_ball_beats_search(count, different_bits, tables)
+
+def ball_beats_sort(count, different_bits, tables):
+    '''
+    Returns whether find_all looks up each hash within different_bits of every
+    one of count hashes in a hash table, rather than sorting this many tables,
+    when it's to find every match.
+    '''
+    return c_ball_beats_sort(count, different_bits, tables)
+
+cdef object to_tuples(Matches& matches, size_t different_bits, distances,
+                      by_distance):
+    '''
+    Returns matches as a list of tuples, or with by_distance, a list of lists
+    of tuples by number of differing bits.
+    '''
+    cdef size_t i
+    cdef list results = []
+    cdef list buckets
+    if by_distance:
+        buckets = [[] for _ in range(different_bits + 1)]
+    for i in range(matches.size()):
+        if distances:
+            match = (matches.first[i], matches.second[i], matches.distance[i])
+        else:
+            match = (matches.first[i], matches.second[i])
+        if by_distance:
+            buckets[matches.distance[i]].append(match)
+        else:
+            results.append(match)
+    return buckets if by_distance else results
+
+def find_all(hashes, number_of_blocks, different_bits, distances=False,
+             by_distance=False, threads=1, tables=None):
     '''
     Find the set of all matches within the provided vector of hashes.
 
-    The provided hashes are manipulated in place, but upon completion are
-    restored to their original state.
+    Each match is a (smaller hash, larger hash) tuple, or, with distances, a
+    (smaller hash, larger hash, number of differing bits) tuple. With
+    by_distance, the matches are instead split into a list of different_bits
+    + 1 lists, where the d-th holds the matches that differ by exactly d bits.
+    The permuted tables are searched on `threads` threads, or one per core if
+    it's 0.
+
+    The number_of_blocks may also be a list of block masks, such as
+    balanced_blocks returns, or None to pick it with choose_blocks.
+
+    For an approximate answer in less time, only some of the tables can be
+    searched: either a list of their indexes in the order Permutation::choose
+    makes them, or a number of them to pick so as to find as many matches as
+    possible. recall gives the fraction of the matches that will be found.
+    '''
+    cdef vector[hash_t] c_hashes = hashes
+    cdef size_t bits = different_bits
+    cdef vector[Permutation] c_permutations = subset(
+        permutations(number_of_blocks, c_hashes, bits), tables, bits)
+    cdef Matches matches
+    cdef c_Pool* pool = shared_pool(threads)
+    with nogil:
+        matches = find_matches(c_hashes, c_permutations, bits, pool[0])
+    return to_tuples(matches, bits, distances, by_distance)
+
+def find_between(queries, corpus, number_of_blocks, different_bits,
+                 distances=False, by_distance=False, threads=1):
     '''
-    cdef matches_t results_set = c_find_all(hashes, number_of_blocks, different_bits)
-    cdef vector[match_t] results_vector
-    results_vector.assign(results_set.begin(), results_set.end())
-    return results_vector
+    Find all the matches between a query and a corpus hash, as find_all does,
+    but with the query first. Pairs within the queries or within the corpus
+    are never compared.
+
+    The corpus may also be a Tables, which is faster when it's searched more
+    than once. Its number_of_blocks and different_bits are used instead.
+    Otherwise, number_of_blocks is as for find_all, and picked for the corpus
+    if it's None.
+    '''
+    if isinstance(corpus, Tables):
+        return corpus.find(queries, distances, by_distance)
+
+    cdef vector[hash_t] c_queries = queries
+    cdef vector[hash_t] c_corpus = corpus
+    cdef size_t bits = different_bits
+    cdef vector[Permutation] c_permutations = permutations(
+        number_of_blocks, c_corpus, bits)
+    cdef Matches matches
+    cdef c_Pool* pool = shared_pool(threads)
+    with nogil:
+        matches = c_find_between(
+            c_queries, c_corpus, c_permutations, bits, pool[0])
+    return to_tuples(matches, bits, distances, by_distance)
+
+def find_all_external(input, output, number_of_blocks, different_bits,
+                      memory=1 << 30, directory=None, threads=1):
+    '''
+    Find all the matches among the hashes in the input file, for when there
+    are too many to fit in memory, and append them to the output file. Returns
+    the number of matches.
+
+    The input holds raw 64-bit hashes in native byte order. Each match is
+    written as its smaller and larger hash in the same format, followed by the
+    number of bits they differ by as a single byte, or struct format '=QQB'.
+    Sorted runs of about `memory` bytes in all are written to a temporary
+    directory inside `directory`, which defaults to the system's.
+
+    The number_of_blocks is as for find_all, and picked from a sample of the
+    input if it's None.
+    '''
+    cdef string c_input = encode_path(input)
+    cdef string c_output = encode_path(output)
+    cdef size_t bits = different_bits
+    cdef vector[hash_t] empty
+    cdef const hash_t[::1] mapped
+    cdef size_t chosen
+    if number_of_blocks is None and os.path.getsize(input) >= 8:
+        with open(input, 'rb') as f:
+            contents = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        try:
+            # A trailing partial hash is reported by the search itself.
+            mapped = memoryview(contents)[:len(contents) // 8 * 8].cast('Q')
+            with nogil:
+                chosen = c_choose_blocks(&mapped[0], mapped.shape[0], bits)
+            number_of_blocks = chosen
+            del mapped
+        finally:
+            contents.close()
+    cdef vector[Permutation] c_permutations = permutations(
+        number_of_blocks, empty, bits)
+    cdef size_t c_memory = memory
+    cdef size_t count
+    cdef string c_runs
+    cdef c_Pool* pool = shared_pool(threads)
+    runs = tempfile.mkdtemp(dir=directory)
+    try:
+        c_runs = encode_path(runs)
+        with nogil:
+            count = find_matches_external(
+                c_input, c_output, c_permutations, bits, c_memory, c_runs,
+                pool[0])
+    finally:
+        shutil.rmtree(runs)
+    return count
+
+cdef class Tables:
+    '''
+    A corpus of hashes sorted once into its permuted tables, so that several
+    batches of queries can be matched against it with find_between. This takes
+    one copy of the corpus per table.
+
+    New hashes can be merged in with add, which returns only the matches that
+    involve them, and the tables can be saved and loaded between runs. If
+    number_of_blocks is as for find_all, and picked for the initial hashes if
+    it's None.
+    '''
+    cdef c_Tables* tables
+    cdef c_Pool* pool
+
+    def __cinit__(self, hashes, number_of_blocks, different_bits, threads=1):
+        cdef vector[hash_t] c_hashes = hashes
+        cdef size_t bits = different_bits
+        cdef vector[Permutation] c_permutations = permutations(
+            number_of_blocks, c_hashes, bits)
+        self.pool = new c_Pool(threads)
+        with nogil:
+            self.tables = new c_Tables(
+                c_hashes, c_permutations, bits, self.pool[0])
+
+    def __dealloc__(self):
+        del self.tables
+        del self.pool
+
+    def find(self, queries, distances=False, by_distance=False):
+        '''Find all the matches between a query and this corpus.'''
+        cdef vector[hash_t] c_queries = queries
+        cdef Matches matches
+        with nogil:
+            matches = self.tables.find(c_queries, self.pool[0])
+        return to_tuples(
+            matches, self.tables.different_bits(), distances, by_distance)
+
+    def add(self, hashes, distances=False, by_distance=False):
+        '''
+        Merge hashes into this corpus, returning the matches, as find_all
+        would, that involve at least one hash that wasn't already in it.
+        '''
+        cdef vector[hash_t] c_hashes = hashes
+        cdef Matches matches
+        with nogil:
+            matches = self.tables.add(c_hashes, self.pool[0])
+        return to_tuples(
+            matches, self.tables.different_bits(), distances, by_distance)
+
+    def save(self, prefix):
+        '''Save each table to its own file, named after prefix.'''
+        cdef string path = encode_path(prefix)
+        with nogil:
+            self.tables.save(path, self.pool[0])
+
+    def load(self, prefix):
+        '''Replace this corpus with the tables saved under prefix.'''
+        cdef string path = encode_path(prefix)
+        with nogil:
+            self.tables.load(path, self.pool[0])
+
+    def __len__(self):
+        return self.tables.size()
+
+cdef class Index:
+    '''
+    An index of hashes that can be queried while new hashes are inserted.
+
+    Inserted hashes are buffered in a small memtable that is searched
+    linearly. Full memtables are sorted into immutable segments, and segments
+    are merged, by a background thread. Segments are built on `threads`
+    threads, or one per core if it's 0.
+
+    The number_of_blocks may also be a list of block masks, as for find_all.
+    '''
+    cdef c_Index* index
+    cdef size_t different_bits
+
+    def __cinit__(self, number_of_blocks, different_bits,
+                  memtable_capacity=16384, merge_factor=4, threads=1):
+        cdef vector[hash_t] empty
+        if number_of_blocks is None:
+            raise ValueError('An Index needs a number of blocks or block masks')
+        self.different_bits = different_bits
+        self.index = new c_Index(
+            permutations(number_of_blocks, empty, different_bits),
+            different_bits, memtable_capacity, merge_factor, threads)
+
+    def __dealloc__(self):
+        del self.index
+
+    def insert(self, hash_t hash, doc_id_t id):
+        '''Add a hash to the index under the provided id.'''
+        with nogil:
+            self.index.insert(hash, id)
+
+    def remove(self, hash_t hash, doc_id_t id):
+        '''Remove a hash inserted under id, returning how many copies there were.'''
+        cdef size_t removed
+        with nogil:
+            removed = self.index.remove(hash, id)
+        return removed
+
+    def find(self, hash_t query):
+        '''Return a list of (hash, id) for every entry near the query.'''
+        cdef vector[entry_t] results
+        with nogil:
+            results = self.index.find(query)
+        return results
+
+    def nearest(self, hash_t query, size_t k=1, max_distance=None):
+        '''
+        Return a list of (hash, id, distance) for the k entries nearest to the
+        query, nearest first, out of those within max_distance of it. This
+        defaults to different_bits, which it can't exceed.
+        '''
+        cdef vector[neighbor_t] results
+        cdef size_t limit = (
+            self.different_bits if max_distance is None else max_distance)
+        with nogil:
+            results = self.index.nearest(query, k, limit)
+        return [
+            (result.second.first, result.second.second, result.first)
+            for result in results
+        ]
+
+    def flush(self):
+        '''Block until every inserted hash has been moved into a segment.'''
+        with nogil:
+            self.index.flush()
+
+    def compact(self):
+        '''Like flush, but also rewrite every segment with removed entries.'''
+        with nogil:
+            self.index.compact()
+
+    def save(self, directory):
+        '''Flush, then save each segment's shards as files in directory.'''
+        cdef string path = encode_path(directory)
+        with nogil:
+            self.index.save(path)
+
+    def load(self, directory):
+        '''Add the segments saved in directory to this index.'''
+        cdef string path = encode_path(directory)
+        with nogil:
+            self.index.load(path)
+
+    def segments(self):
+        '''The number of segments in the index.'''
+        return self.index.segments()
+
+    def __len__(self):
+        return self.index.size()
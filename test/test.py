@@ -1,6 +1,13 @@
 #! /usr/bin/env python
 
+import array
+import os
+import random
 import re
+import shutil
+import struct
+import tempfile
+import threading
 import unittest
 
 import simhash
@@ -15,6 +22,44 @@ class TestNumDifferingBits(unittest.TestCase):
         self.assertEqual(2, simhash.num_differing_bits(a, b))
 
 
+class TestFastHash(unittest.TestCase):
+    '''Tests about the native feature hash.'''
+
+    def test_deterministic(self):
+        self.assertEqual(simhash.fast_hash(b'hello'), simhash.fast_hash(b'hello'))
+        self.assertNotEqual(
+            simhash.fast_hash(b'hello'), simhash.fast_hash(b'hello', seed=1))
+
+    def test_distinct(self):
+        # Every length up to past the 48-byte blocks, and inputs that only
+        # differ by one byte, all hash differently.
+        data = bytes(bytearray(range(200)))
+        hashes = set(simhash.fast_hash(data[:n]) for n in range(len(data) + 1))
+        hashes.update(
+            simhash.fast_hash(data[:i] + b'x' + data[i + 1:100])
+            for i in range(100))
+        self.assertEqual(len(data) + 1 + 100, len(hashes))
+
+    def test_avalanche(self):
+        # Flipping one input bit flips about half the output bits.
+        rand = random.Random(9)
+        flipped = 0
+        trials = 500
+        for _ in range(trials):
+            data = bytearray(rand.getrandbits(8) for _ in range(rand.randrange(1, 64)))
+            before = simhash.fast_hash(bytes(data))
+            data[rand.randrange(len(data))] ^= 1 << rand.randrange(8)
+            flipped += simhash.num_differing_bits(before, simhash.fast_hash(bytes(data)))
+        self.assertAlmostEqual(32, flipped / float(trials), delta=1)
+
+    def test_many(self):
+        objs = [b'', b'a', b'shingle', b'x' * 100]
+        self.assertEqual(
+            [simhash.fast_hash(obj) for obj in objs],
+            list(simhash.fast_hash_many(objs)))
+        self.assertEqual(0, len(simhash.fast_hash_many([])))
+
+
 class TestCompute(unittest.TestCase):
     '''Tests about computing a simhash.'''
 
@@ -34,6 +79,263 @@ class TestCompute(unittest.TestCase):
         hashes = [0xABCD, 0xBCDE, 0xCDEF]
         self.assertEqual(0xADCF, simhash.compute(hashes))
 
+    def test_majority(self):
+        # Lengths around the groups of eight hashes counted at once.
+        rand = random.Random(1)
+        for length in (1, 7, 8, 9, 16, 23, 1000, 4097):
+            hashes = [rand.getrandbits(64) for _ in range(length)]
+            expected = 0
+            for bit in range(64):
+                ones = sum((h >> bit) & 1 for h in hashes)
+                if 2 * ones > length:
+                    expected |= 1 << bit
+            self.assertEqual(expected, simhash.compute(hashes))
+
+
+class TestComputeWeighted(unittest.TestCase):
+    '''Tests about computing a weighted simhash.'''
+
+    def test_unit_weights(self):
+        rand = random.Random(3)
+        for length in (0, 1, 5, 100):
+            hashes = [rand.getrandbits(64) for _ in range(length)]
+            self.assertEqual(
+                simhash.compute(hashes),
+                simhash.compute_weighted(hashes, [1] * length))
+
+    def test_weights(self):
+        # The one heavy hash outweighs the two light ones.
+        hashes = [0xFF00, 0x0FF0, 0x00FF]
+        self.assertEqual(0x0FF0, simhash.compute(hashes))
+        self.assertEqual(0xFF00, simhash.compute_weighted(hashes, [2.5, 1, 1]))
+        self.assertEqual(
+            0xFF00, simhash.compute_weighted(hashes * 2, [4, 1, 1, -1, 0, 0]))
+
+    def test_matches_python(self):
+        rand = random.Random(4)
+        hashes = [rand.getrandbits(64) for _ in range(300)]
+        weights = [rand.uniform(0, 10) for _ in hashes]
+        expected = 0
+        for bit in range(64):
+            total = sum(w if (h >> bit) & 1 else -w for h, w in zip(hashes, weights))
+            if total > 0:
+                expected |= 1 << bit
+        self.assertEqual(expected, simhash.compute_weighted(hashes, weights))
+
+    def test_many(self):
+        # Enough hashes to be split among threads
+        rand = random.Random(5)
+        documents = [
+            [(rand.getrandbits(64), rand.randrange(1, 5))
+             for _ in range(rand.randrange(0, 50))]
+            for _ in range(500)]
+        flat = [h for document in documents for h, _ in document]
+        weights = array.array('d', [w for document in documents for _, w in document])
+        offsets = [0]
+        for document in documents:
+            offsets.append(offsets[-1] + len(document))
+        expected = [
+            simhash.compute_weighted([h for h, _ in d], [w for _, w in d])
+            for d in documents]
+        for threads in (1, 3):
+            self.assertEqual(expected, list(simhash.compute_weighted_many(
+                flat, weights, offsets, threads=threads)))
+        self.assertEqual(expected[:5], list(simhash.compute_weighted_many(
+            flat, weights, offsets[:6], threads=3)))
+
+    def test_mismatched(self):
+        with self.assertRaises(ValueError):
+            simhash.compute_weighted([1, 2], [1])
+        with self.assertRaises(ValueError):
+            simhash.compute_weighted_many([1, 2], [1], [0, 2])
+
+
+class TestAccumulator(unittest.TestCase):
+    '''Tests about keeping a simhash up to date.'''
+
+    def test_empty(self):
+        self.assertEqual(0, simhash.Accumulator().digest())
+
+    def test_sliding_window(self):
+        rand = random.Random(6)
+        hashes = [rand.getrandbits(64) for _ in range(200)]
+        window = 25
+        accumulator = simhash.Accumulator()
+        accumulator.add_all(hashes[:window])
+        for start in range(len(hashes) - window):
+            self.assertEqual(
+                simhash.compute(hashes[start:start + window]),
+                accumulator.digest())
+            accumulator.remove(hashes[start])
+            accumulator.add(hashes[start + window])
+
+    def test_weights(self):
+        rand = random.Random(7)
+        hashes = [rand.getrandbits(64) for _ in range(50)]
+        weights = [rand.randrange(1, 10) for _ in hashes]
+        accumulator = simhash.Accumulator()
+        for h, w in zip(hashes, weights):
+            accumulator.add(h, w)
+        self.assertEqual(
+            simhash.compute_weighted(hashes, weights), accumulator.digest())
+        accumulator.remove(hashes[0], weights[0])
+        self.assertEqual(
+            simhash.compute_weighted(hashes[1:], weights[1:]),
+            accumulator.digest())
+
+    def test_merge(self):
+        rand = random.Random(8)
+        hashes = [rand.getrandbits(64) for _ in range(101)]
+        first = simhash.Accumulator()
+        first.add_all(hashes[:40])
+        second = simhash.Accumulator()
+        second.add_all(hashes[40:])
+        first.merge(second)
+        self.assertEqual(simhash.compute(hashes), first.digest())
+        first.remove_all(hashes[40:])
+        self.assertEqual(simhash.compute(hashes[:40]), first.digest())
+
+
+class TestStoplist(unittest.TestCase):
+    '''Tests about leaving stoplisted features out of simhashes.'''
+
+    hashes = [0, 1, 2, 3, 0xFFFFFFFFFFFFFFFF, 1 << 40, 12345]
+
+    def test_contains(self):
+        stoplist = simhash.Stoplist([3, 0, 12345, 3])
+        self.assertEqual(3, len(stoplist))
+        self.assertIn(0, stoplist)
+        self.assertIn(12345, stoplist)
+        self.assertNotIn(2, stoplist)
+        self.assertEqual(
+            [1, 2, 0xFFFFFFFFFFFFFFFF, 1 << 40],
+            list(stoplist.filter(self.hashes)))
+        self.assertEqual(0, len(simhash.Stoplist()))
+        self.assertNotIn(0, simhash.Stoplist())
+
+    def test_many(self):
+        excluded = list(range(1, 5000, 3))
+        stoplist = simhash.Stoplist(array.array('Q', excluded))
+        self.assertEqual(len(excluded), len(stoplist))
+        for value in range(5000):
+            self.assertEqual(value in excluded, value in stoplist)
+
+    def test_compute(self):
+        boilerplate = [0x0F0F0F0F0F0F0F0F, 0x0F0F0F0F0F0F0F0E, 0x0F0F0F0F0F0F0F0D]
+        content = [0xF0F0F0F0F0F0F0F0, 0xF0F0F0F0F0F0F0F1]
+        stoplist = simhash.Stoplist(boilerplate)
+        self.assertEqual(
+            simhash.compute(content),
+            simhash.compute(content + boilerplate, stoplist))
+        hashes = content + boilerplate + boilerplate + content
+        offsets = [0, 5, 5, 10]
+        for threads in (1, 2):
+            self.assertEqual(
+                [simhash.compute(content), 0, simhash.compute(content)],
+                list(simhash.compute_many(
+                    hashes, offsets, threads=threads, stoplist=stoplist)))
+
+    def test_save_load(self):
+        stoplist = simhash.Stoplist(range(0, 1000, 7))
+        directory = tempfile.mkdtemp()
+        try:
+            path = directory + '/stoplist'
+            stoplist.save(path)
+            loaded = simhash.Stoplist([1, 2])
+            loaded.load(path)
+            self.assertEqual(len(stoplist), len(loaded))
+            self.assertEqual(
+                list(stoplist.filter(range(1000))),
+                list(loaded.filter(range(1000))))
+            self.assertIn(0, loaded)
+
+            with open(path, 'r+b') as f:
+                f.write(b'garbage!')
+            with self.assertRaises(RuntimeError):
+                loaded.load(path)
+            # A failed load leaves the stoplist as it was.
+            self.assertEqual(len(stoplist), len(loaded))
+            with self.assertRaises(RuntimeError):
+                loaded.load(directory + '/missing')
+        finally:
+            shutil.rmtree(directory)
+
+    def test_load_while_computing(self):
+        boilerplate = list(range(0, 1000, 7))
+        hashes = [h for h in range(1000) for _ in range(20)]
+        offsets = list(range(0, len(hashes) + 1, 100))
+        stoplist = simhash.Stoplist(boilerplate)
+        expected = list(simhash.compute_many(hashes, offsets, stoplist=stoplist))
+        directory = tempfile.mkdtemp()
+        try:
+            path = directory + '/stoplist'
+            stoplist.save(path)
+
+            # Replacing the table must not pull it out from under a
+            # computation that's still using it.
+            results = []
+            def compute():
+                for _ in range(50):
+                    results.append(list(simhash.compute_many(
+                        hashes, offsets, stoplist=stoplist)))
+            thread = threading.Thread(target=compute)
+            thread.start()
+            while thread.is_alive():
+                stoplist.load(path)
+            thread.join()
+            for result in results:
+                self.assertEqual(expected, result)
+        finally:
+            shutil.rmtree(directory)
+
+
+class TestComputeMany(unittest.TestCase):
+    '''Tests about computing many simhashes at once.'''
+
+    def test_matches_compute(self):
+        # Enough hashes to be split among threads
+        rand = random.Random(2)
+        documents = [
+            [rand.getrandbits(64) for _ in range(rand.randrange(0, 200))]
+            for _ in range(200)]
+        flat = array.array('Q', [h for document in documents for h in document])
+        offsets = array.array('Q', [0])
+        for document in documents:
+            offsets.append(offsets[-1] + len(document))
+        expected = [simhash.compute(document) for document in documents]
+        for threads in (1, 3):
+            results = simhash.compute_many(flat, offsets, threads=threads)
+            self.assertEqual(array.array('Q', expected), results)
+        self.assertEqual(
+            expected, list(simhash.compute_many(list(flat), list(offsets))))
+
+    def test_shared_pool(self):
+        # Calls from several Python threads take turns with the same pool
+        rand = random.Random(3)
+        flat = array.array('Q', [rand.getrandbits(64) for _ in range(20000)])
+        offsets = array.array('Q', range(0, 20001, 100))
+        expected = simhash.compute_many(flat, offsets)
+        results = []
+
+        def compute():
+            for _ in range(5):
+                results.append(simhash.compute_many(flat, offsets, threads=2))
+        workers = [threading.Thread(target=compute) for _ in range(4)]
+        for worker in workers:
+            worker.start()
+        for worker in workers:
+            worker.join()
+        self.assertEqual([expected] * 20, results)
+
+    def test_empty(self):
+        self.assertEqual(0, len(simhash.compute_many([], [0])))
+        self.assertEqual([0, 0], list(simhash.compute_many([], [0, 0, 0])))
+
+    def test_invalid_offsets(self):
+        for offsets in ([], [0, 2, 1], [0, 4]):
+            with self.assertRaises(ValueError):
+                simhash.compute_many([1, 2, 3], offsets)
+
 
 class TestFindAll(unittest.TestCase):
     '''Tests about find_all.'''
@@ -106,6 +408,537 @@ class TestFindAll(unittest.TestCase):
             self.assertEqual(
                 sorted(expected), sorted(simhash.find_all(hashes, blocks, 3)))
 
+    def test_distances(self):
+        hashes = [0x000000FF, 0x000000EF, 0x000000EE, 0x000000CE, 0x000000FF]
+        expected = [
+            (0x000000CE, 0x000000EE, 1),
+            (0x000000CE, 0x000000EF, 2),
+            (0x000000CE, 0x000000FF, 3),
+            (0x000000EE, 0x000000EF, 1),
+            (0x000000EE, 0x000000FF, 2),
+            (0x000000EF, 0x000000FF, 1)
+        ]
+        for threads in (1, 2, 0):
+            self.assertEqual(expected, sorted(simhash.find_all(
+                hashes, 6, 3, distances=True, threads=threads)))
+
+    def test_by_distance(self):
+        hashes = [0x000000FF, 0x000000EF, 0x000000EE, 0x000000CE]
+        buckets = simhash.find_all(hashes, 6, 3, by_distance=True)
+        self.assertEqual([
+            [],
+            [(0x000000CE, 0x000000EE), (0x000000EE, 0x000000EF),
+             (0x000000EF, 0x000000FF)],
+            [(0x000000CE, 0x000000EF), (0x000000EE, 0x000000FF)],
+            [(0x000000CE, 0x000000FF)]
+        ], [sorted(bucket) for bucket in buckets])
+
+        buckets = simhash.find_all(
+            hashes, 6, 3, distances=True, by_distance=True)
+        for distance, bucket in enumerate(buckets):
+            self.assertTrue(all(match[2] == distance for match in bucket))
+
+    def test_choose_blocks(self):
+        rand = random.Random(1)
+        hashes = [rand.getrandbits(64) for _ in range(5000)]
+        hashes += [h ^ (1 << rand.randrange(64)) for h in hashes[:1000]]
+        for bits in range(0, 5):
+            blocks = simhash.choose_blocks(hashes, bits)
+            self.assertTrue(bits < blocks <= 64)
+            self.assertEqual(
+                sorted(simhash.find_all(hashes, blocks, bits)),
+                sorted(simhash.find_all(hashes, None, bits)))
+        self.assertEqual(4, simhash.choose_blocks([], 3))
+        with self.assertRaises(ValueError):
+            simhash.choose_blocks(hashes, 64)
+
+    def test_block_masks(self):
+        rand = random.Random(2)
+        hashes = [rand.getrandbits(64) for _ in range(3000)]
+        hashes += [h ^ (1 << rand.randrange(64)) for h in hashes[:1000]]
+        masks = [
+            0xFFFF000000000000, 0x0000FFF000000000, 0x0000000FF0000000,
+            0x000000000FFFF000, 0x0000000000000FFF
+        ]
+        expected = sorted(simhash.find_all(hashes, 5, 3))
+        self.assertEqual(expected, sorted(simhash.find_all(hashes, masks, 3)))
+        self.assertEqual(
+            expected, sorted(simhash.find_all(hashes, masks[::-1], 3)))
+
+        for invalid in (masks[1:], masks[:-1] + [0xFF0], masks + [0x1],
+                        masks[:-1] + [0xF0F]):
+            with self.assertRaises(ValueError):
+                simhash.find_all(hashes, invalid, 3)
+        with self.assertRaises(ValueError):
+            simhash.find_all(hashes, masks[:3], 3)
+
+    def test_tables(self):
+        rand = random.Random(4)
+        hashes = [rand.getrandbits(64) for _ in range(2000)]
+        for h in hashes[:1000]:
+            for bit in rand.sample(range(64), rand.randrange(1, 4)):
+                h ^= 1 << bit
+            hashes.append(h)
+        expected = set(simhash.find_all(hashes, 6, 3))
+        self.assertEqual(
+            expected, set(simhash.find_all(hashes, 6, 3, tables=list(range(20)))))
+        for tables in (1, 5, [0, 19], [3]):
+            found = set(simhash.find_all(hashes, 6, 3, tables=tables))
+            self.assertLess(found, expected)
+            self.assertGreater(len(found), 0)
+        with self.assertRaises(ValueError):
+            simhash.find_all(hashes, 6, 3, tables=21)
+        with self.assertRaises(ValueError):
+            simhash.find_all(hashes, 6, 3, tables=[20])
+
+    def test_ball(self):
+        # Enough tables that looking up each hash's neighbors is cheaper.
+        rand = random.Random(6)
+        hashes = [0] + [rand.getrandbits(64) for _ in range(300)]
+        for h in hashes[:150]:
+            for bit in rand.sample(range(64), rand.randrange(0, 3)):
+                h ^= 1 << bit
+            hashes.append(h)
+        for blocks, bits, tables in ((40, 1, 40), (64, 2, 2016)):
+            self.assertTrue(
+                simhash.ball_beats_sort(len(set(hashes)), bits, tables))
+            expected = sorted(
+                (min(a, b), max(a, b), simhash.num_differing_bits(a, b))
+                for i, a in enumerate(set(hashes))
+                for b in list(set(hashes))[i + 1:]
+                if simhash.num_differing_bits(a, b) <= bits)
+            self.assertEqual(expected, sorted(simhash.find_all(
+                hashes, blocks, bits, distances=True, threads=2)))
+
+    def test_ball_beats_sort(self):
+        # Only with many more tables than find_all needs, and more still as
+        # the hash table outgrows the caches.
+        self.assertTrue(simhash.ball_beats_sort(1000, 0, 1))
+        self.assertFalse(simhash.ball_beats_sort(100000, 1, 16))
+        self.assertTrue(simhash.ball_beats_sort(100000, 1, 32))
+        self.assertTrue(simhash.ball_beats_sort(30000, 1, 24))
+        self.assertFalse(simhash.ball_beats_sort(3000000, 1, 24))
+        self.assertFalse(simhash.ball_beats_sort(1000000, 2, 190))
+        self.assertFalse(simhash.ball_beats_sort(1000000, 64, 10 ** 6))
+
+    def test_brute(self):
+        # Few enough hashes, spanning several tiles, that comparing every
+        # pair is cheaper, with clusters so that some are far apart.
+        rand = random.Random(7)
+        hashes = [rand.getrandbits(64) for _ in range(900)]
+        for h in hashes[:301]:
+            for bit in rand.sample(range(64), rand.randrange(0, 12)):
+                h ^= 1 << bit
+            hashes.append(h)
+        unique = sorted(set(hashes))
+        for blocks, bits in ((4, 3), (12, 10)):
+            expected = sorted(
+                (a, b, simhash.num_differing_bits(a, b))
+                for i, a in enumerate(unique)
+                for b in unique[i + 1:]
+                if simhash.num_differing_bits(a, b) <= bits)
+            self.assertEqual(expected, sorted(simhash.find_all(
+                hashes, blocks, bits, distances=True, threads=2)))
+
+    def test_recall(self):
+        self.assertEqual([1.0] * 4, simhash.recall(6, 3))
+        # One table of four 16-bit blocks finds a pair only if every
+        # differing bit is outside its one leading block.
+        expected = [
+            1.0, 48 / 64.0, 48 * 47 / (64 * 63.0),
+            48 * 47 * 46 / (64 * 63 * 62.0)]
+        for actual, wanted in zip(simhash.recall(4, 3, tables=[0]), expected):
+            self.assertAlmostEqual(wanted, actual)
+        recalls = [simhash.recall(6, 3, tables=n)[3] for n in range(1, 21)]
+        self.assertEqual(sorted(recalls), recalls)
+        self.assertAlmostEqual(1.0, recalls[-1])
+        # Every choice of one or two blocks is avoided by some of 7 tables.
+        self.assertEqual([1.0, 1.0, 1.0], simhash.recall(6, 3, tables=7)[:3])
+
+    def test_balanced_blocks(self):
+        # Each bit of the high half is only set a sixteenth of the time.
+        rand = random.Random(3)
+        hashes = []
+        for _ in range(2000):
+            high = rand.getrandbits(32)
+            for _ in range(3):
+                high &= rand.getrandbits(32)
+            hashes.append((high << 32) | rand.getrandbits(32))
+        masks = simhash.balanced_blocks(hashes, 6)
+        self.assertEqual(6, len(masks))
+        self.assertEqual(0xFFFFFFFFFFFFFFFF, sum(masks))
+        self.assertEqual(sorted(masks, reverse=True), masks)
+        # Those predictable bits are lumped into fewer, wider blocks.
+        self.assertGreater(bin(masks[0]).count('1'), 16)
+        self.assertEqual(
+            sorted(simhash.find_all(hashes, 6, 3)),
+            sorted(simhash.find_all(hashes, masks, 3)))
+
+
+class TestFindAllExternal(unittest.TestCase):
+    '''Tests about find_all_external.'''
+
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        self.input = self.directory + '/hashes'
+        self.output = self.directory + '/matches'
+
+    def tearDown(self):
+        shutil.rmtree(self.directory)
+
+    def run_external(self, hashes, **kwargs):
+        with open(self.input, 'wb') as fout:
+            fout.write(struct.pack('=%dQ' % len(hashes), *hashes))
+        count = simhash.find_all_external(
+            self.input, self.output, 6, 3, directory=self.directory, **kwargs)
+        with open(self.output, 'rb') as fin:
+            data = fin.read()
+        self.assertEqual(count * 17, len(data))
+        return [
+            struct.unpack('=QQB', data[i:i + 17])
+            for i in range(0, len(data), 17)]
+
+    def test_basic(self):
+        hashes = [0x000000FF, 0x000000EF, 0x000000EE, 0x000000CE, 0x000000FF]
+        self.assertEqual(
+            sorted(simhash.find_all(hashes, 6, 3, distances=True)),
+            sorted(self.run_external(hashes)))
+
+    def test_many_runs(self):
+        # Enough hashes that even the smallest runs need several of them
+        rand = random.Random(1)
+        hashes = [rand.getrandbits(64) for _ in range(6000)]
+        hashes += [h ^ (1 << rand.randrange(64)) for h in hashes[:4000]]
+        hashes += hashes[:100]
+        expected = sorted(simhash.find_all(hashes, 6, 3, distances=True))
+        self.assertEqual(
+            expected, sorted(self.run_external(hashes, memory=1, threads=2)))
+
+    def test_merge_passes(self):
+        # Nine runs, merged a few at a time over several passes
+        rand = random.Random(2)
+        hashes = [rand.getrandbits(64) for _ in range(30000)]
+        hashes += [h ^ (1 << rand.randrange(64)) for h in hashes[:6000]]
+        expected = sorted(simhash.find_all(hashes, 6, 3, distances=True))
+        for memory in (1, 5 * 4096 * 8):
+            self.assertEqual(
+                expected,
+                sorted(self.run_external(hashes, memory=memory, threads=1)))
+            self.assertEqual(
+                ['hashes', 'matches'], sorted(os.listdir(self.directory)))
+            os.remove(self.output)
+
+    def test_choose_blocks(self):
+        hashes = [0x000000FF, 0x000000EF, 0x000000EE, 0x000000CE, 0x000000FF]
+        with open(self.input, 'wb') as fout:
+            fout.write(struct.pack('=%dQ' % len(hashes), *hashes))
+        self.assertEqual(6, simhash.find_all_external(
+            self.input, self.output, None, 3, directory=self.directory))
+
+    def test_partial_hash(self):
+        with open(self.input, 'wb') as fout:
+            fout.write(b'\x00' * 12)
+        with self.assertRaises(RuntimeError):
+            simhash.find_all_external(self.input, self.output, 6, 3)
+
+
+class TestFindBetween(unittest.TestCase):
+    '''Tests about find_between.'''
+
+    corpus = [
+        0x000000FF, 0x000000EF, 0x0000FF00, 0x0000EF00, 0xFF000000
+    ]
+
+    queries = [0x000000EE, 0x0000CE00, 0x33000000, 0x000000EE]
+
+    expected = [
+        (0x000000EE, 0x000000EF, 1),
+        (0x000000EE, 0x000000FF, 2),
+        (0x0000CE00, 0x0000EF00, 2),
+        (0x0000CE00, 0x0000FF00, 3)
+    ]
+
+    def test_basic(self):
+        for blocks in range(4, 10):
+            self.assertEqual(
+                [match[:2] for match in self.expected],
+                sorted(simhash.find_between(
+                    self.queries, self.corpus, blocks, 3)))
+
+    def test_cross_only(self):
+        # The corpus matches itself, and the queries match each other
+        matches = simhash.find_between(
+            [0x000000EE, 0x000000EF], [0x000000FF, 0x000000FE], 6, 1)
+        self.assertEqual(
+            [(0x000000EE, 0x000000FE), (0x000000EF, 0x000000FF)],
+            sorted(matches))
+
+    def test_tables(self):
+        tables = simhash.Tables(self.corpus, 6, 3, threads=2)
+        self.assertEqual(len(self.corpus), len(tables))
+        for _ in range(2):
+            self.assertEqual(
+                self.expected, sorted(tables.find(self.queries, distances=True)))
+        self.assertEqual(
+            self.expected,
+            sorted(simhash.find_between(
+                self.queries, tables, 6, 3, distances=True)))
+        self.assertEqual([], tables.find([0xFFFFFFFFFFFFFFFF]))
+
+    def test_add(self):
+        tables = simhash.Tables(self.corpus, 6, 3)
+        matches = tables.add(self.queries + [0x000000FF], distances=True)
+        self.assertEqual(len(self.corpus) + 3, len(tables))
+        self.assertEqual(sorted(
+            (min(a, b), max(a, b), d) for a, b, d in self.expected
+        ), sorted(matches))
+
+        # Together with the matches before, they're those of the whole corpus
+        before = simhash.find_all(self.corpus, 6, 3)
+        after = simhash.find_all(self.corpus + self.queries, 6, 3)
+        self.assertEqual(
+            sorted(after), sorted(before + [m[:2] for m in matches]))
+        self.assertEqual([], tables.add(self.queries))
+
+    def test_save_load(self):
+        directory = tempfile.mkdtemp()
+        try:
+            prefix = directory + '/corpus'
+            simhash.Tables(self.corpus, 6, 3, threads=2).save(prefix)
+            tables = simhash.Tables([], 6, 3)
+            tables.load(prefix)
+            self.assertEqual(len(self.corpus), len(tables))
+            self.assertEqual(
+                self.expected, sorted(tables.find(self.queries, distances=True)))
+
+            with self.assertRaises(ValueError):
+                simhash.Tables([], 7, 3).load(prefix)
+            with self.assertRaises(RuntimeError):
+                tables.load(directory + '/missing')
+
+            # Blocks of the same widths in other places permute other bits
+            wide_first = [0xFFFFFF << 40] + [0xFF << (8 * i) for i in range(5)]
+            wide_last = [0xFF << (8 * i) for i in range(3, 8)] + [0xFFFFFF]
+            simhash.Tables(self.corpus, wide_first, 3).save(prefix)
+            simhash.Tables([], wide_first, 3).load(prefix)
+            with self.assertRaises(ValueError):
+                simhash.Tables([], wide_last, 3).load(prefix)
+        finally:
+            shutil.rmtree(directory)
+
+    def test_invalid(self):
+        with self.assertRaises(ValueError):
+            simhash.Tables(self.corpus, 3, 3)
+
+
+class TestIndex(unittest.TestCase):
+    '''Tests about the incrementally-built index.'''
+
+    hashes = [
+        0x000000FF, 0x000000EF, 0x000000EE, 0x000000CE, 0x00000033,
+        0x0000FF00, 0x0000EF00, 0x0000EE00, 0x0000CE00, 0x00003300,
+        0x00FF0000, 0x00EF0000, 0x00EE0000, 0x00CE0000, 0x00330000,
+        0xFF000000, 0xEF000000, 0xEE000000, 0xCE000000, 0x33000000
+    ]
+
+    def expected(self, query):
+        return sorted(
+            (h, i) for i, h in enumerate(self.hashes)
+            if simhash.num_differing_bits(h, query) <= 3)
+
+    def test_memtable(self):
+        index = simhash.Index(6, 3)
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        self.assertEqual(len(self.hashes), len(index))
+        self.assertEqual(0, index.segments())
+        for query in self.hashes:
+            self.assertEqual(self.expected(query), index.find(query))
+
+    def test_segments(self):
+        index = simhash.Index(6, 3, memtable_capacity=2, merge_factor=2)
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        index.flush()
+        self.assertEqual(len(self.hashes), len(index))
+        self.assertLess(index.segments(), len(self.hashes) // 2)
+        for query in self.hashes:
+            self.assertEqual(self.expected(query), index.find(query))
+
+    def test_block_masks(self):
+        masks = simhash.balanced_blocks(self.hashes, 6)
+        index = simhash.Index(masks, 3, memtable_capacity=4, merge_factor=2)
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        index.flush()
+        for query in self.hashes:
+            self.assertEqual(self.expected(query), index.find(query))
+        with self.assertRaises(ValueError):
+            simhash.Index(None, 3)
+
+    def test_missing(self):
+        index = simhash.Index(6, 3, memtable_capacity=4)
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        self.assertEqual([], index.find(0xFFFFFFFFFFFFFFFF))
+
+    def test_nearest(self):
+        index = simhash.Index(6, 3, memtable_capacity=4, merge_factor=2)
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        index.flush()
+        index.insert(0x000000FE, 100)
+        self.assertEqual(
+            [(0x000000FF, 0, 0), (0x000000EF, 1, 1)],
+            index.nearest(0x000000FF, 2))
+        self.assertEqual(
+            [(0x000000FE, 100, 0), (0x000000EE, 2, 1), (0x000000FF, 0, 1)],
+            index.nearest(0x000000FE, 3, 1))
+        self.assertEqual(
+            [(0x000000FF, 0, 1)],
+            index.nearest(0x000001FF, 2, 1))
+        for query in self.hashes:
+            expected = sorted(
+                (simhash.num_differing_bits(h, query), h, i)
+                for h, i in self.expected(query))
+            self.assertEqual(
+                [(h, i, d) for d, h, i in expected if i != 100],
+                [n for n in index.nearest(query, 100) if n[1] != 100])
+        self.assertEqual([], index.nearest(0xFFFFFFFFFFFFFFFF, 5))
+        self.assertEqual([], index.nearest(0x000000FF, 0))
+        with self.assertRaises(ValueError):
+            index.nearest(0x000000FF, 1, 4)
+
+    def test_probe(self):
+        # With a distance of one and 64 tables, a segment of a few thousand
+        # looks up every neighbor of the query instead of searching them.
+        rand = random.Random(8)
+        noise = [rand.getrandbits(64) for _ in range(6000)]
+        hashes = noise + self.hashes + [0, 0x000000FF]
+        self.assertTrue(simhash.ball_beats_search(len(hashes), 1, 64))
+        index = simhash.Index(64, 1, memtable_capacity=len(hashes))
+        for i, h in enumerate(hashes):
+            index.insert(h, i)
+        index.flush()
+        for query in hashes[-22:] + [0x1, 0x000001FF]:
+            self.assertEqual(sorted(
+                (h, i) for i, h in enumerate(hashes)
+                if simhash.num_differing_bits(h, query) <= 1),
+                index.find(query))
+        offset = len(noise)
+        self.assertEqual(1, index.remove(0x000000FF, offset))
+        self.assertEqual([(0x000000EF, offset + 1), (0x000000FF, offset + 21)],
+                         index.find(0x000000FF))
+        self.assertEqual([(0, offset + 20, 0)], index.nearest(0, 5, 0))
+        self.assertEqual(
+            [(0x000000FF, offset + 21, 0), (0x000000EF, offset + 1, 1)],
+            index.nearest(0x000000FF, 5))
+
+    def test_ball_beats_search(self):
+        # Exact queries always, and one-bit queries with many tables of many
+        # hashes, whose searches miss the caches.
+        self.assertTrue(simhash.ball_beats_search(100000, 0, 1))
+        self.assertFalse(simhash.ball_beats_search(20, 1, 10))
+        self.assertFalse(simhash.ball_beats_search(10000, 1, 24))
+        self.assertTrue(simhash.ball_beats_search(1000000, 1, 24))
+        self.assertFalse(simhash.ball_beats_search(1000000, 2, 120))
+
+    def test_remove(self):
+        index = simhash.Index(6, 3, memtable_capacity=4, merge_factor=2)
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        index.flush()
+        # The last few are still in the memtable
+        index.insert(0x000000FE, 100)
+        self.assertEqual(1, index.remove(0x000000FE, 100))
+        self.assertEqual(1, index.remove(0x000000EF, 1))
+        self.assertEqual(0, index.remove(0x000000EF, 1))
+        self.assertEqual(0, index.remove(0x000000EE, 1))
+        self.assertEqual(len(self.hashes) - 1, len(index))
+        self.assertEqual(
+            [(0x000000FF, 0), (0x000000EE, 2), (0x000000CE, 3)],
+            sorted(index.find(0x000000FF), key=lambda e: e[1]))
+
+    def test_compact(self):
+        index = simhash.Index(6, 3, memtable_capacity=4, merge_factor=2)
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        for i, h in enumerate(self.hashes):
+            if i % 5:
+                index.remove(h, i)
+        index.compact()
+        self.assertEqual(4, len(index))
+        self.assertEqual([(0x000000FF, 0)], index.find(0x000000FF))
+        for i, h in enumerate(self.hashes):
+            index.remove(h, i)
+        index.compact()
+        self.assertEqual(0, len(index))
+        self.assertEqual(0, index.segments())
+
+    def test_concurrent(self):
+        index = simhash.Index(6, 3, memtable_capacity=2, merge_factor=2)
+        errors = []
+
+        def query():
+            for _ in range(200):
+                for match in index.find(0x000000FF):
+                    if match not in self.expected(0x000000FF):
+                        errors.append(match)
+
+        readers = [threading.Thread(target=query) for _ in range(4)]
+        for reader in readers:
+            reader.start()
+        for i, h in enumerate(self.hashes):
+            index.insert(h, i)
+        for reader in readers:
+            reader.join()
+        index.flush()
+        self.assertEqual([], errors)
+        self.assertEqual(self.expected(0x000000FF), index.find(0x000000FF))
+
+    def test_save_load(self):
+        directory = tempfile.mkdtemp()
+        try:
+            index = simhash.Index(6, 3, memtable_capacity=4, threads=2)
+            for i, h in enumerate(self.hashes):
+                index.insert(h, i)
+            index.remove(0x000000EF, 1)
+            index.save(directory)
+            # A manifest, and one file for each table of each segment
+            self.assertEqual(
+                1 + 20 * index.segments(), len(os.listdir(directory)))
+
+            loaded = simhash.Index(6, 3, threads=2)
+            loaded.load(directory)
+            self.assertEqual(len(self.hashes) - 1, len(loaded))
+            self.assertEqual(
+                [(0x000000FF, 0), (0x000000EE, 2), (0x000000CE, 3)],
+                sorted(loaded.find(0x000000FF), key=lambda e: e[1]))
+
+            with self.assertRaises(ValueError):
+                simhash.Index(7, 3).load(directory)
+
+            # Blocks of the same widths in other places permute other bits
+            wide_first = [0xFFFFFF << 40] + [0xFF << (8 * i) for i in range(5)]
+            wide_last = [0xFF << (8 * i) for i in range(3, 8)] + [0xFFFFFF]
+            index = simhash.Index(wide_first, 3)
+            for i, h in enumerate(self.hashes):
+                index.insert(h, i)
+            index.save(directory)
+            simhash.Index(wide_first, 3).load(directory)
+            with self.assertRaises(ValueError):
+                simhash.Index(wide_last, 3).load(directory)
+        finally:
+            shutil.rmtree(directory)
+
+    def test_load_missing(self):
+        with self.assertRaises(RuntimeError):
+            simhash.Index(6, 3).load('/nonexistent/directory')
+
+    def test_invalid(self):
+        with self.assertRaises(ValueError):
+            simhash.Index(3, 3)
+
 
 class TestShingle(unittest.TestCase):
     '''Tests about computing shingles of tokens.'''
@@ -138,6 +971,186 @@ class TestShingle(unittest.TestCase):
         self.assertEqual(expected, list(simhash.shingle(tokens, 4)))
 
 
+class TestTokenize(unittest.TestCase):
+    '''Tests about tokenizing text natively.'''
+
+    def hashes(self, words):
+        return [simhash.fast_hash(word.encode('utf8')) for word in words]
+
+    def test_ascii(self):
+        self.assertEqual(
+            self.hashes([u'hello', u'world', u'42']),
+            list(simhash.tokenize(b'Hello, World! 42')))
+        self.assertEqual(0, len(simhash.tokenize(b' ,.!? ')))
+
+    def test_unicode(self):
+        self.assertEqual(
+            list(simhash.tokenize(u'caf\xe9 \u03c3\u03bf\u03c6\u03af\u03b1')),
+            list(simhash.tokenize(u'CAF\xc9 \u03a3\u039f\u03a6\u038a\u0391')))
+        # Latin Extended-B, with its titlecase digraphs and irregular pairs.
+        self.assertEqual(
+            self.hashes([u'\u01c6', u'\u01c6', u'\u0219\u021b', u'\u0253\u01dd\u01ce',
+                         u'\u2c65\u0180']),
+            list(simhash.tokenize(
+                u'\u01c4 \u01c5 \u0218\u021a \u0181\u018e\u01cd \u023a\u0243')))
+        # Unicode punctuation separates tokens, and fullwidth forms are ASCII.
+        self.assertEqual(
+            self.hashes([u'na\xefve', u'test', u'quoted', u'abc123']),
+            list(simhash.tokenize(
+                u'na\xefve\u2014test \u201cquoted\u201d \uff21\uff42\uff43\uff11\uff12\uff13')))
+
+    def test_invalid_utf8(self):
+        # Overlong forms, surrogates and anything beyond U+10FFFF aren't
+        # decoded, so each of their bytes is kept as it is.
+        for invalid in (b'\xc1\x81', b'\xe0\x81\x81', b'\xf0\x80\x81\x81',
+                        b'\xed\xa0\x80', b'\xed\xbf\xbf', b'\xf4\x90\x80\x80'):
+            self.assertEqual(
+                [simhash.fast_hash(invalid)], list(simhash.tokenize(invalid)))
+        self.assertNotEqual(
+            list(simhash.tokenize(b'\xc1\x81')), list(simhash.tokenize(b'a')))
+        for valid in (u'\xe9', u'\u0800', u'\ud7ff', u'\ue000', u'\U00010000',
+                      u'\U0010ffff'):
+            self.assertEqual(
+                self.hashes([valid]), list(simhash.tokenize(valid.encode('utf8'))))
+
+    def test_ideographs(self):
+        self.assertEqual(
+            self.hashes([u'\u6211', u'\u7231', u'\u5317', u'\u4eac', u'tokyo']),
+            list(simhash.tokenize(u'\u6211\u7231\u5317\u4eac\u3002Tokyo')))
+
+    def test_mask_numbers(self):
+        self.assertEqual(
+            self.hashes([u'on', u'0000', u'00', u'00', u'v0']),
+            list(simhash.tokenize(b'on 2023-01-05 v2', mask_numbers=True)))
+        self.assertEqual(
+            simhash.fingerprint(b'Posted on 2023-01-05 by admin', mask_numbers=True),
+            simhash.fingerprint(b'Posted on 2024-11-30 by admin', mask_numbers=True))
+        self.assertNotEqual(
+            simhash.fingerprint(b'Posted on 2023-01-05 by admin'),
+            simhash.fingerprint(b'Posted on 2024-11-30 by admin'))
+        self.assertEqual(
+            [simhash.fingerprint(b'v2 of 3', 1, mask_numbers=True)],
+            list(simhash.fingerprint_many([b'v2 of 3'], 1, mask_numbers=True)))
+
+    def test_pipeline(self):
+        text = TestFunctional.jabberwocky
+        self.assertEqual(
+            simhash.fingerprint(text, 3),
+            simhash.compute(list(simhash.shingle_hashes(simhash.tokenize(text), 3))))
+
+
+class TestShingleHashes(unittest.TestCase):
+    '''Tests about hashing shingles of token hashes natively.'''
+
+    tokens = [simhash.fast_hash(word) for word in b'a b c d e f g'.split()]
+
+    def test_rolling(self):
+        shingles = simhash.shingle_hashes(self.tokens, 3)
+        self.assertEqual(5, len(shingles))
+        for i, shingle in enumerate(shingles):
+            self.assertEqual(
+                [shingle], list(simhash.shingle_hashes(self.tokens[i:i + 3], 3)))
+
+    def test_matches_fingerprint(self):
+        self.assertEqual(
+            simhash.fingerprint(b'A b, c d! E f g', window=3),
+            simhash.compute(list(simhash.shingle_hashes(self.tokens, 3))))
+
+    def test_windows(self):
+        expected = []
+        for window in (1, 3, 5):
+            expected.extend(simhash.shingle_hashes(self.tokens, window))
+        self.assertEqual(
+            sorted(expected),
+            sorted(simhash.shingle_hashes(array.array('Q', self.tokens), [5, 1, 3])))
+
+    def test_fewer_than_window(self):
+        # A single shingle of them all, however many windows are that wide.
+        self.assertEqual(
+            list(simhash.shingle_hashes(self.tokens[:2], 2)),
+            list(simhash.shingle_hashes(self.tokens[:2], [4, 8])))
+        self.assertEqual(0, len(simhash.shingle_hashes([], 4)))
+        with self.assertRaises(ValueError):
+            simhash.shingle_hashes(self.tokens, [2, 0])
+
+
+class TestCharNgrams(unittest.TestCase):
+    '''Tests about hashing character n-grams natively.'''
+
+    def test_rolling(self):
+        text = u'\u4f60\u597d\u4e16\u754c!'
+        ngrams = simhash.char_ngrams(text, 2)
+        self.assertEqual(4, len(ngrams))
+        for i, ngram in enumerate(ngrams):
+            self.assertEqual([ngram], list(simhash.char_ngrams(text[i:i + 2], 2)))
+
+    def test_normalized(self):
+        self.assertEqual(
+            list(simhash.char_ngrams(b'  Hello,\t\tWorld \n')),
+            list(simhash.char_ngrams(u'hello, world')))
+        self.assertEqual(
+            simhash.char_ngrams(b'abcabc')[0], simhash.char_ngrams(b'abcabc')[3])
+
+    def test_short(self):
+        self.assertEqual(1, len(simhash.char_ngrams(b'ab', 5)))
+        self.assertEqual(0, len(simhash.char_ngrams(b' \n ')))
+        # Bytes that aren't UTF-8 are characters of their own.
+        self.assertEqual(3, len(simhash.char_ngrams(b'\xff\xfeab', 2)))
+        with self.assertRaises(ValueError):
+            simhash.char_ngrams(b'ab', 0)
+
+    def test_accumulator(self):
+        text = TestFunctional.jabberwocky
+        accumulator = simhash.Accumulator()
+        accumulator.add_ngrams(text, 4)
+        self.assertEqual(
+            simhash.compute(list(simhash.char_ngrams(text, 4))),
+            accumulator.digest())
+
+
+class TestFingerprint(unittest.TestCase):
+    '''Tests about fingerprinting text natively.'''
+
+    def test_normalized(self):
+        self.assertEqual(
+            simhash.fingerprint(b'Hello, World! How are you?'),
+            simhash.fingerprint(u'hello world   how ARE you'))
+
+    def test_empty(self):
+        self.assertEqual(0, simhash.fingerprint(b''))
+        self.assertEqual(0, simhash.fingerprint(b' ,.!? '))
+
+    def test_short(self):
+        # Fewer tokens than the window still make one shingle.
+        self.assertNotEqual(0, simhash.fingerprint(b'two words'))
+        self.assertNotEqual(
+            simhash.fingerprint(b'two words'),
+            simhash.fingerprint(b'two words', window=1))
+        with self.assertRaises(ValueError):
+            simhash.fingerprint(b'two words', window=0)
+
+    def test_near_duplicates(self):
+        text = TestFunctional.jabberwocky
+        a = simhash.fingerprint(text)
+        b = simhash.fingerprint(text + ' - Lewis Carroll (Alice in Wonderland)')
+        c = simhash.fingerprint(TestFunctional.pope)
+        self.assertLessEqual(
+            simhash.num_differing_bits(a, b), TestFunctional.MATCH_THRESHOLD)
+        self.assertGreater(
+            simhash.num_differing_bits(a, c), TestFunctional.MATCH_THRESHOLD)
+
+    def test_many(self):
+        # Enough text to be split among threads
+        texts = [
+            TestFunctional.jabberwocky, TestFunctional.pope, b'', u'caf\xe9',
+            b'one two three four five'] * 4
+        for threads in (1, 2):
+            self.assertEqual(
+                [simhash.fingerprint(text, 3) for text in texts],
+                list(simhash.fingerprint_many(texts, 3, threads=threads)))
+        self.assertEqual(0, len(simhash.fingerprint_many([])))
+
+
 class TestFunctional(unittest.TestCase):
     '''Can the tool be used functionally.'''
 